@@ -4,7 +4,14 @@
 
 // This is a textual shell problem analogous to bash.  Runs commands directly from
 // prompt.  Also allows user to run commands from a separate file (in our case,
-// simple.sh) and execute them either in series or in parallel.
+// simple.sh) and execute them either in series or in parallel.  In parallel,
+// "PARALLEL -j N file" runs at most N commands at a time (default: one per
+// core) and reports each exit code as soon as its command finishes.  After
+// either, a summary of the wall time, CPU time, and memory of the commands is
+// shown; "--csv=file" and/or "--json=file" also save the statistics of each.
+// "DAG file" runs each line as soon as the lines it depends on succeeded.  A
+// line may start with a label and prerequisites, as in a makefile rule:
+// "label: prereq1 prereq2 ; command" (or just "label: command").
 
 // BASE CASE
 /* > # Lines starting with pound signs are to be ignored.↵ * > echo "hello, world!" ↵ * Running: echo hello, world! * hello, world! * Exit code: 0 * > ↵ * > head -2 /proc/cpuinfo↵ * Running: head -2 /proc/cpuinfo * processor : 0 * vendor_id : GenuineIntel * Exit code: 0 * > ↵ * > # A regular sleep test. ↵ * > sleep 1↵ * Running: sleep 1 * Exit code: 0 * > ↵ * > # Finally exit out↵ * > exit↵
@@ -19,14 +26,21 @@
  * Running: sleep 1s * Exit code: 0 * Exit code: 0 * Exit code: 0 * Exit code: 0 * Exit code: 0 * > exit↵
  */
 
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <functional>
+#include <set>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -39,10 +53,49 @@ using namespace std;
  * 5: Interpret as command (Case 4)
  */
 
+/**
+ * Options of a SERIAL, PARALLEL, or DAG line, given before the file name
+ */
+struct RunOptions {
+    int slots = 1;     // commands run at a time (PARALLEL/DAG -j N)
+    string csvFile;    // --csv=file, "" if not given
+    string jsonFile;   // --json=file, "" if not given
+};
+
+/**
+ * Resource usage of 1 command run by SERIAL or PARALLEL
+ */
+struct JobStats {
+    size_t line;       // line number of the command in the file
+    string command;    // its words, separated by 1 space
+    int exitCode;      // status from wait4
+    double wallTime;   // seconds from fork until it was reaped
+    rusage usage;      // CPU time, max RSS, context switches
+};
+
+/**
+ * A command of a PARALLEL or DAG run, which is started once all of its
+ * prerequisites succeeded
+ */
+struct Step {
+    string command;             // as given to forkExec
+    string label;               // "" if it has none
+    vector<size_t> prereqs;     // indexes of steps to succeed first
+    vector<size_t> dependents;  // indexes of steps waiting for this one
+    JobStats job;               // its line, and statistics once it ran
+    bool ran = false;
+};
+
 int shellCommand(istream& in);
 int forkExec(string& command);
-void serial(vector<string>& commands);
-void parallel(vector<string>& commands);
+vector<JobStats> serial(vector<string>& commands);
+string commandText(const string& line);
+vector<JobStats> parallel(vector<string>& commands, int slots);
+vector<JobStats> dag(vector<string>& commands, int slots);
+vector<JobStats> runSteps(vector<Step>& steps, int slots);
+RunOptions gatherRunOptions(stringstream& in, bool parallel);
+void reportRun(const vector<JobStats>& jobs, double wallTime,
+        const RunOptions& options);
 vector<string> gatherArguments(string& line);
 void myExec(vector<string> argList);
 vector<string> gatherFileCommands(stringstream& in);
@@ -50,9 +103,10 @@ void executeFromShell(string& line);
 
 /**
  * Asks the user for input.  Assumes user will input:
- * 1. "SERIAL [filename]"
- * 2. "PARALLEL [filename]"
- * 3. "exit"
+ * 1. "SERIAL [--csv=file] [--json=file] [filename]"
+ * 2. "PARALLEL [-j N] [--csv=file] [--json=file] [filename]"
+ * 3. "DAG [-j N] [--csv=file] [--json=file] [filename]"
+ * 4. "exit"
  * If none of the above, assume input is a command 
  * (such as echo "hello, world!")
  * @param in
@@ -67,16 +121,21 @@ int shellCommand(istream& in) {
     // exit command (Case 1)
     if (command == "exit") {
         return 1;
-    } else if (command == "SERIAL") {
-        // serial command (Case 2)
-        // get a list of file commands and to be executed serially
+    } else if (command == "SERIAL" || command == "PARALLEL" ||
+               command == "DAG") {
+        // serial command (Case 2), parallel command (Case 3), or DAG
+        // get a list of file commands and to be executed serially or in
+        // parallel (at most options.slots at a time), then report on them
+        const bool inParallel = (command != "SERIAL");
+        RunOptions options = gatherRunOptions(inStream, inParallel);
         vector<string> fileCommands = gatherFileCommands(inStream);
-        serial(fileCommands);
-    } else if (command == "PARALLEL") {
-        // parallel command (Case 3)
-        // get a list of file commands and to be executed in parallel
-        vector<string> fileCommands = gatherFileCommands(inStream);
-        parallel(fileCommands);
+        const auto start = chrono::steady_clock::now();
+        vector<JobStats> jobs = (!inParallel ? serial(fileCommands) :
+            command == "PARALLEL" ? parallel(fileCommands, options.slots) :
+            dag(fileCommands, options.slots));
+        const chrono::duration<double> wallTime =
+            chrono::steady_clock::now() - start;
+        reportRun(jobs, wallTime.count(), options);
     } else if (command[0] != '#' && command != "") {
         // ignore comments (starting with "#")
         // assume first word is a program and following words are args (Case 4)
@@ -115,59 +174,466 @@ vector<string> gatherFileCommands(stringstream& in) {
     return fileCommands;
 }
 
+/**
+ * Given the rest of a "SERIAL", "PARALLEL" or "DAG" line, read the options
+ * before the file name: "-j N" (or "-jN", not SERIAL) giving the number of
+ * commands to run at a time, and "--csv=file" and "--json=file" naming files
+ * to save the statistics of each command in
+ * @param in
+ * @param parallel
+ * @return The options; slots defaults to the number of cores in parallel
+ */
+RunOptions gatherRunOptions(stringstream& in, bool parallel) {
+    RunOptions options;
+    if (parallel) {
+        options.slots = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    while (true) {
+        const streampos start = in.tellg();
+        string option;
+        in >> option;
+        if (parallel && option.compare(0, 2, "-j") == 0) {
+            string count = option.substr(2);
+            if (count.empty()) {
+                in >> count;
+            }
+            options.slots = max(1, atoi(count.c_str()));
+        } else if (option.compare(0, 6, "--csv=") == 0) {
+            options.csvFile = option.substr(6);
+        } else if (option.compare(0, 7, "--json=") == 0) {
+            options.jsonFile = option.substr(7);
+        } else {
+            // not an option, so it is the file name
+            in.clear();
+            in.seekg(start);
+            return options;
+        }
+    }
+}
+
+/**
+ * Obtain a line of a file as it is shown in reports: its words separated
+ * by 1 space (so tabs and runs of blanks do not upset a CSV or JSON file)
+ * @param line
+ * @return 
+ */
+string commandText(const string& line) {
+    stringstream cmdStream(line);
+    string text, word;
+    while (cmdStream >> word) {
+        text += (text.empty() ? "" : " ") + word;
+    }
+    return text;
+}
+
 /**
  * Executes commands serially
  * @param commands
+ * @return The statistics of each command run, in order
  */
-void serial(vector<string>& commands) {
+vector<JobStats> serial(vector<string>& commands) {
+    using Clock = chrono::steady_clock;
+    vector<JobStats> jobs;
     // fork and exec all commands
-    for (auto command : commands) {
+    for (size_t i = 0; i < commands.size(); i++) {
+        string& command = commands[i];
         stringstream cmdStream(command);
         // check to see if line is a comment
         string firstArg;
         cmdStream >> firstArg;
         if (firstArg[0] != '#' && firstArg != "") {
             // fork and exec the command
+            JobStats job = {i + 1, commandText(command), 0, 0, {}};
+            const Clock::time_point start = Clock::now();
             int pid = forkExec(command);
-            int exitCode;
-            waitpid(pid, &exitCode, 0);
+            wait4(pid, &job.exitCode, 0, &job.usage);
+            const chrono::duration<double> elapsed = Clock::now() - start;
+            job.wallTime = elapsed.count();
             // display exit code
-            cout << "Exit code: " << exitCode << endl;
+            cout << "Exit code: " << job.exitCode << endl;
+            jobs.push_back(job);
         }
     }
+    return jobs;
 }
 
 /**
- * Executes commands in parallel
+ * Executes commands in parallel, with at most slots of them running at a
+ * time (see runSteps)
  * @param commands
+ * @param slots
+ * @return The statistics of each command run, in the order they finished
  */
-void parallel(vector<string>& commands) {
-    /* FIRST GATHER ARGUMENTS FOR COMMAND THEN (IF '#', REJECT)
-     * PRINT OUT "Running: "
-     * THEN PRINT OUT ALL ARGS
-     * THEN PRINT OUTPUT
-     * THEN PRINT EXIT CODE (which is output of waitpid (type pid_t))
-     */
-    
-    // store all pids in vector, once we fork and exec all commands
-    // we will go and use waitpid for every pid in the pid vector
-    vector<int> pids;
-    for (auto command : commands) {
-        stringstream cmdStream(command);
+vector<JobStats> parallel(vector<string>& commands, int slots) {
+    vector<Step> steps;
+    for (size_t i = 0; i < commands.size(); i++) {
+        stringstream cmdStream(commands[i]);
         // check to see if line is a comment
         string firstArg;
         cmdStream >> firstArg;
         if (firstArg[0] != '#' && firstArg != "") {
-            // fork and exec the command, pid is place in a vector for later
-            pids.push_back(forkExec(command));
+            Step step;
+            step.command = commands[i];
+            step.job = {i + 1, commandText(commands[i]), 0, 0, {}};
+            steps.push_back(step);
+        }
+    }
+    return runSteps(steps, slots);
+}
+
+/**
+ * Given a line of a DAG file, obtain the step for it: its label and the
+ * labels of its prerequisites, if it starts with "label: prereqs ;" or
+ * "label:", and the command after them
+ * @param line
+ * @param prereqs Set to the labels of the prerequisites
+ * @return The step, without its prerequisites & line number filled in
+ */
+Step parseStep(const string& line, vector<string>& prereqs) {
+    Step step;
+    step.command = line;
+    stringstream cmdStream(line);
+    string first, word;
+    cmdStream >> first;
+    if (first.back() != ':') {
+        return step;  // not labeled
+    }
+    step.label = first.substr(0, first.size() - 1);
+    const streampos afterLabel = cmdStream.tellg();
+    step.command = (afterLabel == -1 ? "" : line.substr(afterLabel));
+    // the words up to a ";" are prerequisites (if there is a ";")
+    while (cmdStream >> word) {
+        if (word.back() == ';') {
+            word.pop_back();
+            if (!word.empty()) {
+                prereqs.push_back(word);
+            }
+            const streampos afterPrereqs = cmdStream.tellg();
+            step.command = (afterPrereqs == -1 ? "" :
+                            line.substr(afterPrereqs));
+            return step;
+        }
+        prereqs.push_back(word);
+    }
+    prereqs.clear();  // no ";", so they are all part of the command
+    return step;
+}
+
+/**
+ * Executes the commands of a DAG file: each one as soon as all of its
+ * prerequisites succeeded, with at most slots running at a time.  The
+ * graph is checked (for unknown labels and cycles) before anything is
+ * run.  Commands depending on one that failed are skipped.  At the end,
+ * the critical path -- the chain of commands that took longest, which
+ * no number of slots could make faster -- is shown
+ * @param commands
+ * @param slots
+ * @return The statistics of each command run, in the order they finished
+ */
+vector<JobStats> dag(vector<string>& commands, int slots) {
+    vector<Step> steps;
+    vector<vector<string>> prereqs;
+    unordered_map<string, size_t> labels;
+    for (size_t i = 0; i < commands.size(); i++) {
+        stringstream cmdStream(commands[i]);
+        // check to see if line is a comment
+        string firstArg;
+        cmdStream >> firstArg;
+        if (firstArg[0] == '#' || firstArg == "") {
+            continue;
+        }
+        prereqs.push_back({});
+        Step step = parseStep(commands[i], prereqs.back());
+        step.job = {i + 1, commandText(step.command), 0, 0, {}};
+        if (step.job.command.empty()) {
+            cout << "No command on line " << i + 1 << endl;
+            return {};
+        }
+        if (!step.label.empty() &&
+            !labels.emplace(step.label, steps.size()).second) {
+            cout << "Duplicate label " << step.label << " on line " << i + 1
+                 << endl;
+            return {};
+        }
+        steps.push_back(step);
+    }
+    // link each step with its prerequisites
+    vector<size_t> waiting(steps.size());
+    for (size_t i = 0; i < steps.size(); i++) {
+        for (const string& label : prereqs[i]) {
+            auto prereq = labels.find(label);
+            if (prereq == labels.end()) {
+                cout << "Unknown prerequisite " << label << " on line "
+                     << steps[i].job.line << endl;
+                return {};
+            }
+            steps[i].prereqs.push_back(prereq->second);
+            steps[prereq->second].dependents.push_back(i);
+            waiting[i]++;
         }
     }
-    // waitpid for every command after they have been forked
-    for (int pid : pids) {
+    // sort the steps topologically: a step is added once all of its
+    // prerequisites are, so steps left out are on (or after) a cycle
+    vector<size_t> order;
+    for (size_t i = 0; i < steps.size(); i++) {
+        if (waiting[i] == 0) {
+            order.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        for (size_t dependent : steps[order[i]].dependents) {
+            if (--waiting[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        }
+    }
+    if (order.size() < steps.size()) {
+        cout << "Cycle in prerequisites of lines:";
+        for (size_t i = 0; i < steps.size(); i++) {
+            if (waiting[i] > 0) {
+                cout << " " << steps[i].job.line;
+            }
+        }
+        cout << endl;
+        return {};
+    }
+    vector<JobStats> jobs = runSteps(steps, slots);
+    // the longest time to finish each step, counting its prerequisites,
+    // and the prerequisite it waited for the longest
+    vector<double> finish(steps.size());
+    vector<size_t> slowest(steps.size(), steps.size());
+    size_t last = steps.size();
+    for (size_t i : order) {
+        if (!steps[i].ran) {
+            continue;
+        }
+        for (size_t prereq : steps[i].prereqs) {
+            if (slowest[i] == steps.size() || finish[prereq] >
+                finish[slowest[i]]) {
+                slowest[i] = prereq;
+            }
+        }
+        finish[i] = steps[i].job.wallTime +
+            (slowest[i] == steps.size() ? 0 : finish[slowest[i]]);
+        if (last == steps.size() || finish[i] > finish[last]) {
+            last = i;
+        }
+    }
+    if (last != steps.size()) {
+        string path;
+        for (size_t i = last; i != steps.size(); i = slowest[i]) {
+            const string name = (steps[i].label.empty() ? "line " +
+                to_string(steps[i].job.line) : steps[i].label);
+            path = name + (path.empty() ? "" : " -> ") + path;
+        }
+        cout << "Critical path: " << fixed << setprecision(2)
+             << finish[last] << " sec (" << path << ")" << defaultfloat
+             << endl;
+    }
+    return jobs;
+}
+
+/**
+ * Run steps in parallel, with at most slots of them running at a time.  A
+ * step is started (in the order of the steps) once all its prerequisites
+ * succeeded and a slot is free; whenever one exits another one is started
+ * in its place.  Each exit code is displayed right away (with the line
+ * number in the file and how long the command ran), so a slow command
+ * does not hold up the others.  The steps depending on one that failed
+ * are skipped
+ * @param steps Set to ran, with the statistics, once they ran
+ * @param slots
+ * @return The statistics of each command run, in the order they finished
+ */
+vector<JobStats> runSteps(vector<Step>& steps, int slots) {
+    using Clock = chrono::steady_clock;
+    // the steps ready to run (in order) and the number of prerequisites
+    // each one is still waiting for
+    set<size_t> ready;
+    vector<size_t> waiting(steps.size());
+    for (size_t i = 0; i < steps.size(); i++) {
+        waiting[i] = steps[i].prereqs.size();
+        if (waiting[i] == 0) {
+            ready.insert(i);
+        }
+    }
+    // the step & start time of each running command, by pid
+    unordered_map<int, pair<size_t, Clock::time_point>> running;
+    vector<JobStats> jobs;
+    // skip the steps depending on a failed one (& on them, and so on)
+    vector<bool> skipped(steps.size());
+    function<void(size_t)> skipDependents = [&](size_t failed) {
+        for (size_t dependent : steps[failed].dependents) {
+            if (!skipped[dependent]) {
+                skipped[dependent] = true;
+                cout << "Skipped: " << steps[dependent].job.command
+                     << " (line " << steps[dependent].job.line << ")"
+                     << endl;
+                skipDependents(dependent);
+            }
+        }
+    };
+    while (!ready.empty() || !running.empty()) {
+        // fill the free job slots with the next ready steps
+        while (running.size() < size_t(slots) && !ready.empty()) {
+            const size_t next = *ready.begin();
+            ready.erase(ready.begin());
+            // fork and exec the command, remembering when it started
+            running[forkExec(steps[next].command)] = {next, Clock::now()};
+        }
+        // wait for whichever command finishes first
         int exitCode;
-        waitpid(pid, &exitCode, 0);
-        // display exit code
-        cout << "Exit code: " << exitCode << endl;
+        rusage usage;
+        const int pid = wait4(-1, &exitCode, 0, &usage);
+        if (pid == -1) {
+            break;
+        }
+        auto entry = running.find(pid);
+        if (entry == running.end()) {
+            continue;
+        }
+        Step& step = steps[entry->second.first];
+        const chrono::duration<double> elapsed = Clock::now() -
+            entry->second.second;
+        step.job.exitCode = exitCode;
+        step.job.wallTime = elapsed.count();
+        step.job.usage = usage;
+        step.ran = true;
+        // display exit code, with the line and elapsed time
+        cout << "Exit code: " << exitCode << " (line " << step.job.line
+             << ", " << fixed << setprecision(2) << step.job.wallTime
+             << " sec)" << defaultfloat << endl;
+        jobs.push_back(step.job);
+        if (exitCode != 0) {
+            skipDependents(entry->second.first);
+        } else {
+            for (size_t dependent : step.dependents) {
+                if (--waiting[dependent] == 0 && !skipped[dependent]) {
+                    ready.insert(dependent);
+                }
+            }
+        }
+        running.erase(entry);
+    }
+    return jobs;
+}
+
+/**
+ * Obtain the CPU time in a timeval as seconds
+ * @param time
+ * @return 
+ */
+double seconds(const timeval& time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+/**
+ * Quote a string for CSV or JSON by escaping each quote (and, for JSON,
+ * each backslash and control character) in it
+ * @param str
+ * @param escape What to put before a quote: "\"" for CSV, "\\" for JSON
+ * @return The quoted string
+ */
+string quote(const string& str, const string& escape) {
+    const bool json = (escape == "\\");
+    string quoted = "\"";
+    for (char c : str) {
+        if (json && static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            quoted += code;
+            continue;
+        }
+        if (c == '"' || (c == '\\' && json)) {
+            quoted += escape;
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Print a summary of the commands run by SERIAL or PARALLEL: how long the
+ * run took versus the total time of the commands (i.e., the time to run
+ * them one after the other), their total CPU time, and the slowest ones.
+ * The statistics of each command are also saved to the CSV and/or JSON
+ * files named in the options
+ * @param jobs
+ * @param wallTime The time the whole run took, in seconds
+ * @param options
+ */
+void reportRun(const vector<JobStats>& jobs, double wallTime,
+        const RunOptions& options) {
+    if (jobs.empty()) {
+        return;  // nothing was run (e.g., the DAG was not valid)
+    }
+    double serialTime = 0, userTime = 0, systemTime = 0;
+    long maxRss = 0;
+    for (const JobStats& job : jobs) {
+        serialTime += job.wallTime;
+        userTime += seconds(job.usage.ru_utime);
+        systemTime += seconds(job.usage.ru_stime);
+        maxRss = max(maxRss, job.usage.ru_maxrss);
+    }
+    cout << fixed << setprecision(2) << "Jobs: " << jobs.size()
+         << ", wall time: " << wallTime << " sec, serial time: "
+         << serialTime << " sec, speedup: "
+         << (wallTime > 0 ? serialTime / wallTime : 1) << "x\n"
+         << "CPU time: " << userTime << " sec user, " << systemTime
+         << " sec system; Max memory (RSS): " << maxRss << " KB\n";
+    // list the slowest (up to 5) commands
+    vector<JobStats> slowest = jobs;
+    sort(slowest.begin(), slowest.end(),
+         [](const JobStats& a, const JobStats& b) {
+             return a.wallTime > b.wallTime;
+         });
+    slowest.resize(min<size_t>(slowest.size(), 5));
+    if (!slowest.empty()) {
+        cout << "Slowest jobs:\n" << setw(6) << "Line" << setw(10) << "Wall"
+             << setw(10) << "User" << setw(10) << "System" << setw(12)
+             << "RSS (KB)" << setw(14) << "Switches" << "  Command\n";
+    }
+    for (const JobStats& job : slowest) {
+        cout << setw(6) << job.line << setw(10) << job.wallTime << setw(10)
+             << seconds(job.usage.ru_utime) << setw(10)
+             << seconds(job.usage.ru_stime) << setw(12)
+             << job.usage.ru_maxrss << setw(14)
+             << (to_string(job.usage.ru_nvcsw) + "/" +
+                 to_string(job.usage.ru_nivcsw)) << "  " << job.command
+             << "\n";
+    }
+    cout << defaultfloat << flush;
+    if (!options.csvFile.empty()) {
+        ofstream csv(options.csvFile);
+        csv << "line,command,exit_code,wall_sec,user_sec,system_sec,"
+            << "max_rss_kb,vol_switches,invol_switches\n";
+        for (const JobStats& job : jobs) {
+            csv << job.line << ',' << quote(job.command, "\"") << ','
+                << job.exitCode << ',' << job.wallTime << ','
+                << seconds(job.usage.ru_utime) << ','
+                << seconds(job.usage.ru_stime) << ',' << job.usage.ru_maxrss
+                << ',' << job.usage.ru_nvcsw << ',' << job.usage.ru_nivcsw
+                << '\n';
+        }
+    }
+    if (!options.jsonFile.empty()) {
+        ofstream json(options.jsonFile);
+        json << "{\"wallTime\": " << wallTime << ", \"serialTime\": "
+             << serialTime << ", \"slots\": " << options.slots
+             << ", \"jobs\": [";
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const JobStats& job = jobs[i];
+            json << (i == 0 ? "\n" : ",\n") << "  {\"line\": " << job.line
+                 << ", \"command\": " << quote(job.command, "\\")
+                 << ", \"exitCode\": " << job.exitCode << ", \"wallTime\": "
+                 << job.wallTime << ", \"userTime\": "
+                 << seconds(job.usage.ru_utime) << ", \"systemTime\": "
+                 << seconds(job.usage.ru_stime) << ", \"maxRss\": "
+                 << job.usage.ru_maxrss << ", \"volSwitches\": "
+                 << job.usage.ru_nvcsw << ", \"involSwitches\": "
+                 << job.usage.ru_nivcsw << "}";
+        }
+        json << "\n]}\n";
     }
 }
 
@@ -182,6 +648,8 @@ int forkExec(string& command) {
         // get arguments for the command
         vector<string> arguments = gatherArguments(command);
         myExec(arguments);
+        // only reached if the command could not be run
+        _exit(127);
     }
     return pid;
 }
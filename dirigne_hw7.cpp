@@ -11,23 +11,71 @@
  *               2018 Noah Dirig
  */
 
+// Build with: g++ -std=c++17 -O2 dirigne_hw7.cpp -o dirigne_hw7 -lpthread -lz
+//
 // Run from command line with following arguments: [input file], std::cout, [true/false]
 // Supplied input files include base_case1_inputs.txt, base_case2_inputs.txt
 // For argument 3, use true to generate a graph
+//
+// Run as a server with: [port] [--threads=N] [--max-header=bytes]
+//     [--max-headers=N] [--report-interval=sec] [--keep-alive-timeout=sec]
+//     [--max-requests=N] [--file-cache=bytes] [--max-cached-file=bytes] [--chunk-size=bytes]
+//     [--flush-delay=msec] [--sample-interval=msec] [--max-samples=N]
+//     [--spawner=fork|posix|zygote] [--max-children=N]
+//     [--max-per-command=N] [--command-limit=cmd:N] [--max-queue=N]
+//     [--retry-after=sec] [--timeout=sec] [--cpu-limit=sec] [--mem-limit=MB]
+//     [--gzip-level=0-9] [--gzip-min-size=bytes] [--cache=cmd:ttl]
+//     [--output-cache=bytes] [--max-cached-output=bytes] [--max-jobs=N]
+//     [--history=file] [--history-size=bytes]
+//
+// Process many requests concurrently, each response to its own file in
+// the output directory, with: --batch [input directory, manifest, or
+//     file of requests] [output directory] [true/false] [--threads=N]
+//
+// Compare how long starting a child takes as the server grows with:
+//     --spawn-bench [--threads=N]
+//
+// Measure how long parsing a request line & headers takes with:
+//     --parse-bench
 
-#include <ext/stdio_filebuf.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <zlib.h>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <deque>
+#include <list>
 #include <string>
+#include <string_view>
 #include <fstream>
+#include <unordered_map>
 #include <sstream>
 #include <vector>
 #include <memory>
+#include <numeric>
 #include <thread>
 #include <mutex>
+#include <functional>
+#include <future>
 
 // Using namespaces to streamline code below
 using namespace std;
@@ -35,51 +83,238 @@ using namespace boost::asio;
 using namespace boost::asio::ip;
 
 
+/** One sample of the resource usage of a child process. */
+struct StatSample {
+    int time;           // Milliseconds since the child was started
+    float userTime;     // User CPU time in seconds
+    float systemTime;   // System CPU time in seconds
+    long memory;        // Resident set size (RSS) in KB
+    long virtualMemory; // Virtual memory size / 1000 (the offline page)
+    long minorFaults;   // Page faults not needing disk I/O
+    long majorFaults;   // Page faults that needed disk I/O
+    long volSwitches;   // Voluntary context switches (e.g., waiting I/O)
+    long involSwitches; // Involuntary context switches (preempted)
+    long readBytes;     // Bytes read from storage
+    long writeBytes;    // Bytes written to storage
+};
+
+/** Exit code, resource usage, and (downsampled) statistics of a child
+    process once it has finished. */
+struct ChildResult {
+    int exitCode = 0;
+    rusage usage = {};
+    std::vector<StatSample> samples;
+    std::string reason;  // Why it was terminated or "" if it just exited
+    int runTime = 0;     // Milliseconds from start until it was reaped
+};
+
+/** The output & result of a command, kept by the CommandCache. */
+struct CachedResult {
+    std::string output;   // Output of the command, as is
+    ChildResult result;   // Exit code, usage, and samples
+    std::chrono::steady_clock::time_point expires;
+};
+
+using CachedResultPtr = std::shared_ptr<const CachedResult>;
+
+/** Limits on a child process.  0 means no limit. */
+struct ExecLimits {
+    int timeout = 0;     // Wall-clock seconds
+    int cpuTime = 0;     // CPU seconds
+    long memory = 0;     // Address space in MB
+};
+
 // Forward declaration for method defined further below
 void serveClient(std::istream& is, std::ostream& os, bool genFlag);
-const string html1();
-void html2(int pid, string& html2Str, bool genChart);
-string getStats(int pid, vector<string>& values);
+string html1(bool genChart, long jobId = 0);
+string html1Start(bool genChart);
+string jobLink(long jobId);
+string html1End();
+string html2(const ChildResult& result);
+string classicHtml1();
+string classicHtml2(const ChildResult& result, bool genChart);
+string sampleScript(const StatSample& sample, bool halved);
+string sampleArgs(const StatSample& sample);
+void appendEscaped(std::string& out, const char* data, size_t len);
+std::string chunk(const std::string& data);
+std::string chunkHeader(size_t size);
 string strFl(float fl);
 
-std::mutex statMutex;
+/** Settings for the server that can be changed from the command-line
+    via options of the form "--name=value".
+ */
+struct ServerConfig {
+    /** Number of threads running the io_service. 0 = one per core. */
+    unsigned int threads = 0;
+    /** Maximum size (in bytes) of request line + headers from client. */
+    size_t maxHeaderSize = 8192;
+    /** Maximum number of headers in a request from client. */
+    size_t maxHeaders = 64;
+    /** Seconds between reports of connection and thread counts. */
+    int reportInterval = 5;
+    /** Seconds an idle persistent connection is kept open. */
+    int keepAliveTimeout = 5;
+    /** Maximum requests served on 1 connection. 1 = close every time. */
+    int maxRequests = 100;
+    /** Total bytes of static files kept in memory by the file cache. */
+    size_t fileCacheSize = 16 * 1024 * 1024;
+    /** Larger files are not cached but sent directly with sendfile. */
+    size_t maxCachedFile = 1024 * 1024;
+    /** Output from a child process is sent in chunks of up to this size. */
+    size_t chunkSize = 16384;
+    /** Milliseconds a partial chunk of child output may wait to fill up. */
+    int flushDelay = 50;
+    /** Milliseconds between samples of statistics of child processes. */
+    int sampleInterval = 1000;
+    /** Maximum samples of a child process kept and shown (even number). */
+    size_t maxSamples = 512;
+    /** How child processes are started: fork, posix, or zygote. */
+    std::string spawner = "posix";
+    /** Maximum commands running at once. 0 = no limit. */
+    size_t maxChildren = 256;
+    /** Maximum instances of each command running at once. 0 = no limit. */
+    size_t maxPerCommand = 0;
+    /** Limits for specific commands, overriding maxPerCommand. */
+    std::unordered_map<std::string, size_t> commandLimits;
+    /** Maximum requests waiting for a command to finish before 503s. */
+    size_t maxQueue = 256;
+    /** Seconds clients are told to wait before retrying after a 503. */
+    int retryAfter = 1;
+    /** Default (and maximum) limits on commands, which requests may
+        lower with the timeout, cpu, and mem query parameters. */
+    ExecLimits limits;
+    /** zlib level (1-9) for compressing responses. 0 = no compression. */
+    int gzipLevel = 6;
+    /** Static files smaller than this are not compressed. */
+    size_t gzipMinSize = 1024;
+    /** Commands whose results are cached, with their TTL in seconds. */
+    std::unordered_map<std::string, int> cacheTtl;
+    /** Total bytes of command output kept in the command cache. */
+    size_t outputCacheSize = 16 * 1024 * 1024;
+    /** Results with more output than this are not cached. */
+    size_t maxCachedOutput = 1024 * 1024;
+    /** Finished jobs whose statistics can still be streamed. */
+    size_t maxJobs = 64;
+    /** File in which the history of commands run is kept. "" = none. */
+    std::string historyFile;
+    /** Size of a new history file; older runs are dropped to fit. */
+    size_t historySize = 16 * 1024 * 1024;
+};
 
-// shared_ptr is a garbage collected pointer!
-using TcpStreamPtr = std::shared_ptr<tcp::iostream>;
+ServerConfig config;
 
-/** Simple method to be run from a separate thread.
- *
- * @param client The client socket to be processed.
+/**
+ * A histogram of durations with fixed buckets, for the /metrics page.
+ * Recording a duration only increments atomic counters, so threads
+ * never wait for each other to record.
  */
-void threadMain(TcpStreamPtr client) {
-    // Call routine/regular helper method.
-    serveClient(*client, *client, true);
-}
+class Histogram {
+public:
+    /** Record 1 duration, in seconds. */
+    void observe(double seconds) {
+        size_t bucket = 0;
+        while ((bucket < Bounds.size()) && (seconds > Bounds[bucket])) {
+            bucket++;
+        }
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        sumNanos.fetch_add(seconds * 1e9, std::memory_order_relaxed);
+    }
+
+    /** Record the time elapsed since a given time. */
+    void observeSince(std::chrono::steady_clock::time_point start) {
+        observe(std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    /** Write the histogram in Prometheus text format. */
+    void write(std::ostream& os, const std::string& name,
+               const std::string& help) const {
+        os << "# HELP " << name << ' ' << help << "\n# TYPE " << name
+           << " histogram\n";
+        uint64_t total = 0;
+        for (size_t i = 0; (i <= Bounds.size()); i++) {
+            total += counts[i].load(std::memory_order_relaxed);
+            os << name << "_bucket{le=\"";
+            if (i < Bounds.size()) {
+                os << Bounds[i];
+            } else {
+                os << "+Inf";
+            }
+            os << "\"} " << total << '\n';
+        }
+        os << name << "_sum " << sumNanos.load() / 1e9 << '\n'
+           << name << "_count " << total << '\n';
+    }
+
+private:
+    /** Upper bounds of the buckets in seconds (+Inf is implied). */
+    static constexpr std::array<double, 16> Bounds = {
+        0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+        0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 10};
+    std::array<std::atomic<uint64_t>, Bounds.size() + 1> counts = {};
+    std::atomic<uint64_t> sumNanos{0};
+};
+
+constexpr std::array<double, 16> Histogram::Bounds;
+
+/** Counters and histograms shown on the /metrics page. */
+struct Metrics {
+    std::atomic<long> cgiRequests{0}, staticRequests{0}, notFoundRequests{0},
+        rejectedRequests{0}, metricsRequests{0};
+    std::atomic<long> bytesSent{0};
+    std::atomic<long> cacheHits{0}, cacheMisses{0}, cacheJoins{0};
+    std::atomic<int> activeChildren{0};
+    Histogram headerParse, spawn, firstByte, response;
+};
+
+Metrics metrics;
+
+// Number of connections currently open and total accepted so far.
+std::atomic<int> activeConnections(0);
+std::atomic<long> totalConnections(0);
 
 /**
- * Runs the program as a server that listens to incoming connections.
+ * Obtain the metrics of the server in Prometheus text format.
  * 
- * @param port The port number on which the server should listen.
+ * @return The text for the /metrics page.
  */
-void runServer(int port) {
-    // Setup a server socket to accept connections on the socket
-    io_service service;
-    // Create end point
-    tcp::endpoint myEndpoint(tcp::v4(), port);
-    // Create a socket that accepts connections
-    tcp::acceptor server(service, myEndpoint);
-    std::cout << "Server is listening on " << port 
-              << " & ready to process clients...\n";
-    // Process client connections one-by-one...forever
-    while (true) {
-        // Create garbage-collect object on heap
-        TcpStreamPtr client = std::make_shared<tcp::iostream>();
-        // Wait for a client to connect
-        server.accept(*client->rdbuf());
-        // Create a separate thread to process the client.
-        std::thread thr(threadMain, client);
-        thr.detach();
+std::string metricsText() {
+    std::ostringstream os;
+    os << "# HELP hw7_requests_total Requests served by type.\n"
+       << "# TYPE hw7_requests_total counter\n";
+    const std::pair<const char*, long> requests[] = {
+        {"cgi", metrics.cgiRequests}, {"static", metrics.staticRequests},
+        {"not_found", metrics.notFoundRequests},
+        {"rejected", metrics.rejectedRequests},
+        {"metrics", metrics.metricsRequests}};
+    for (const auto& req : requests) {
+        os << "hw7_requests_total{type=\"" << req.first << "\"} "
+           << req.second << '\n';
     }
+    os << "# HELP hw7_command_cache_total Cacheable commands by result.\n"
+       << "# TYPE hw7_command_cache_total counter\n"
+       << "hw7_command_cache_total{result=\"hit\"} " << metrics.cacheHits
+       << "\nhw7_command_cache_total{result=\"miss\"} " << metrics.cacheMisses
+       << "\nhw7_command_cache_total{result=\"joined\"} " << metrics.cacheJoins
+       << '\n';
+    os << "# HELP hw7_sent_bytes_total Bytes sent to clients.\n"
+       << "# TYPE hw7_sent_bytes_total counter\n"
+       << "hw7_sent_bytes_total " << metrics.bytesSent << '\n'
+       << "# HELP hw7_active_children Child processes running.\n"
+       << "# TYPE hw7_active_children gauge\n"
+       << "hw7_active_children " << metrics.activeChildren << '\n'
+       << "# HELP hw7_active_connections Client connections open.\n"
+       << "# TYPE hw7_active_connections gauge\n"
+       << "hw7_active_connections " << activeConnections << '\n';
+    metrics.headerParse.write(os, "hw7_header_parse_seconds",
+                              "Time to parse the request line & headers.");
+    metrics.spawn.write(os, "hw7_spawn_seconds",
+                        "Time to start a child process.");
+    metrics.firstByte.write(os, "hw7_first_byte_seconds",
+                            "Time from request to first byte of response.");
+    metrics.response.write(os, "hw7_response_seconds",
+                           "Time from request to end of response.");
+    return os.str();
 }
 
 // Forward declaration for method used further below.
@@ -92,25 +327,216 @@ const int READ = 0, WRITE = 1;
 const std::string RootFile = "index.html";
 
 /**
- * This method is a convenience method that extracts file or command
- * from a string of the form: "GET <path> HTTP/1.1"
+ * An incremental parser for the request line and headers of an HTTP
+ * request.  The request is parsed in place: the method, path, query
+ * string, and headers are string views into the caller's buffer, so
+ * parsing does not allocate memory.  Each call to parse resumes from
+ * where the previous one stopped, so a request arriving in pieces is
+ * scanned only once.  The buffer must not move (but may grow) between
+ * calls and while the views are in use.
+ *
+ * The size of the request line & headers is limited to
+ * config.maxHeaderSize bytes and the number of headers to
+ * config.maxHeaders.
+ */
+class RequestParser {
+public:
+    /** The result of parsing the data received so far. */
+    enum Result { Incomplete, Complete, Invalid, TooLarge };
+
+    /** A header's name and value (without surrounding spaces). */
+    using Header = std::pair<std::string_view, std::string_view>;
+
+    RequestParser() : headers(config.maxHeaders) {}
+
+    /**
+     * Continue parsing a request from data received so far.
+     *
+     * @param data The start of the request (same as in previous calls).
+     * @param len The number of bytes received so far.
+     * @return Complete once the blank line ending the headers is found,
+     * Incomplete if more data is needed, Invalid for a malformed
+     * request, or TooLarge if a limit was exceeded.
+     */
+    Result parse(const char* data, size_t len) {
+        while (const char* nl = static_cast<const char*>(
+                   memchr(data + scanned, '\n', len - scanned))) {
+            std::string_view line(data + scanned, nl - data - scanned);
+            scanned = nl - data + 1;
+            if (!line.empty() && (line.back() == '\r')) {
+                line.remove_suffix(1);
+            }
+            if (method.empty()) {
+                // Empty lines before the request line (such as the CRLF
+                // some clients send after a POST body) are ignored, as
+                // recommended by RFC 9112, section 2.2.
+                if (!line.empty() && !parseRequestLine(line)) {
+                    return Invalid;
+                }
+            } else if (line.empty()) {
+                return Complete;
+            } else if (numHeaders == headers.size()) {
+                return TooLarge;
+            } else if (!parseHeader(line)) {
+                return Invalid;
+            }
+        }
+        return (len >= config.maxHeaderSize ? TooLarge : Incomplete);
+    }
+
+    /** Prepare to parse the next request. */
+    void reset() {
+        method = target = path = query = version = {};
+        numHeaders = scanned = 0;
+    }
+
+    /** The number of bytes in the request line & headers, once parsed. */
+    size_t size() const { return scanned; }
+
+    /**
+     * Obtain the value of a header.  Header names are matched without
+     * regard to case.
+     *
+     * @param name The name of the header.
+     * @return The value of the header or "" if it is not present.
+     */
+    std::string_view header(std::string_view name) const {
+        for (size_t i = 0; (i < numHeaders); i++) {
+            if (equalsIgnoreCase(headers[i].first, name)) {
+                return headers[i].second;
+            }
+        }
+        return {};
+    }
+
+    /**
+     * Obtain the (still URL-encoded) value of a query parameter.
+     *
+     * @param name The name of the parameter.
+     * @return The value of the parameter or "" if it is not present.
+     */
+    std::string_view queryParam(std::string_view name) const {
+        for (std::string_view rest = query; !rest.empty(); ) {
+            const size_t amp = rest.find('&');
+            const std::string_view param = rest.substr(0, amp);
+            if ((param.size() > name.size()) && (param[name.size()] == '=') &&
+                (param.compare(0, name.size(), name) == 0)) {
+                return param.substr(name.size() + 1);
+            }
+            rest = (amp == std::string_view::npos ? std::string_view() :
+                    rest.substr(amp + 1));
+        }
+        return {};
+    }
+
+    /**
+     * Determine if the client wants the connection kept open after the
+     * response.  HTTP/1.1 connections are persistent unless the client
+     * sends "Connection: close"; HTTP/1.0 ones only with "keep-alive".
+     *
+     * @return true if the connection should be kept open.
+     */
+    bool keepAlive() const {
+        const std::string_view conn = header("connection");
+        if (version == "HTTP/1.0") {
+            return equalsIgnoreCase(conn, "keep-alive");
+        }
+        return !equalsIgnoreCase(conn, "close");
+    }
+
+    /** The parts of the request line, e.g., "GET", "/a?x=1", "a",
+        "x=1", "HTTP/1.1".  The path excludes the leading '/'. */
+    std::string_view method, target, path, query, version;
+
+private:
+    /** Split "GET /path?query HTTP/1.1" into its parts. */
+    bool parseRequestLine(std::string_view line) {
+        const size_t spc1 = line.find(' '), spc2 = line.rfind(' ');
+        if ((spc1 == 0) || (spc1 == std::string_view::npos) ||
+            (spc2 == spc1) || (line[spc1 + 1] != '/')) {
+            return false;
+        }
+        method  = line.substr(0, spc1);
+        target  = line.substr(spc1 + 1, spc2 - spc1 - 1);
+        version = line.substr(spc2 + 1);
+        const size_t qmark = target.find('?');
+        path  = target.substr(1, qmark - 1);
+        query = (qmark == std::string_view::npos ? std::string_view() :
+                 target.substr(qmark + 1));
+        return true;
+    }
+
+    /** Add a header of the form "Name: value". */
+    bool parseHeader(std::string_view line) {
+        const size_t colon = line.find(':');
+        if ((colon == 0) || (colon == std::string_view::npos)) {
+            return false;
+        }
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' ||
+                                  value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' ||
+                                  value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        headers[numHeaders++] = {line.substr(0, colon), value};
+        return true;
+    }
+
+    static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+        return (a.size() == b.size()) &&
+            (strncasecmp(a.data(), b.data(), a.size()) == 0);
+    }
+
+    /** Room for config.maxHeaders headers, allocated once. */
+    std::vector<Header> headers;
+    size_t numHeaders = 0;
+    /** Bytes scanned so far: up to the end of the last complete line. */
+    size_t scanned = 0;
+};
+
+/**
+ * This method is a convenience method that obtains the file or command
+ * from a parsed request, e.g., "cgi-bin/exec?cmd=ls" for
+ * "GET /cgi-bin/exec?cmd=ls HTTP/1.1".
  * 
  * @param req The request from which the file path is to be extracted.
  * @return The path to the file requested
  */
-std::string getFilePath(const std::string& req) {
-    // std::cout << req << std::endl;
-    size_t spc1 = req.find(' '), spc2 = req.rfind(' ');
-    if ((spc1 == std::string::npos) || (spc2 == std::string::npos)) {
-        return "";  // Invalid or unhandled type of request.
-    }
-    std::string path = req.substr(spc1 + 2, spc2 - spc1 - 2);
+std::string getFilePath(const RequestParser& req) {
+    std::string path(req.target.substr(req.target.empty() ? 0 : 1));
     if (path == "") {
         return RootFile;  // default root file
     }
     return path;
 }
 
+/** Helper method to send HTTP 400 (or 431) message back to the client.
+
+    This method is called in cases where a request could not be parsed
+    or exceeded the limits on its size.  The connection is then closed.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] result Why the request could not be parsed.
+ */
+void send400(std::ostream& os, RequestParser::Result result) {
+    const bool tooLarge = (result == RequestParser::TooLarge);
+    const std::string msg = (tooLarge ? "Request headers are too large" :
+                             "Invalid request");
+    // Send a fixed message back to the client.
+    os << (tooLarge ? "HTTP/1.1 431 Request Header Fields Too Large\r\n" :
+           "HTTP/1.1 400 Bad Request\r\n")
+       << "Content-Type: text/plain\r\n"
+       << "Transfer-Encoding: chunked\r\n"
+       << "Connection: Close\r\n\r\n";
+    // Send the chunked data and trailer to end stream to client.
+    os << chunk(msg) << "0\r\n\r\n";
+}
+
 /** Helper method to send HTTP 404 message back to the client.
 
     This method is called in cases where the specified file name is
@@ -121,20 +547,74 @@ std::string getFilePath(const std::string& req) {
     written.
 
     \param[in] path The file path that is invalid.
+
+    \param[in] keepAlive If true the connection is kept open for
+    further requests from the client.
  */
-void send404(std::ostream& os, const std::string& path) {
+void send404(std::ostream& os, const std::string& path,
+             bool keepAlive = false) {
     const std::string msg = "The following file was not found: " + path;
     // Send a fixed message back to the client.
     os << "HTTP/1.1 404 Not Found\r\n"
        << "Content-Type: text/plain\r\n"
        << "Transfer-Encoding: chunked\r\n"        
-       << "Connection: Close\r\n\r\n";
-    // Send the chunked data to client.
-    os << std::hex << msg.size() << "\r\n";
-    // Write the actual data for the line.
-    os << msg << "\r\n";
-    // Send trailer out to end stream to client.
-    os << "0\r\n\r\n";
+       << "Connection: " << (keepAlive ? "keep-alive" : "Close")
+       << "\r\n\r\n";
+    // Send the chunked data and trailer to end stream to client.
+    os << chunk(msg) << "0\r\n\r\n";
+}
+
+/** Helper method to send HTTP 503 message back to the client.
+
+    This method is called when a command cannot be run because too
+    many commands are already running or waiting to run.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] cmd The command that was not run.
+
+    \param[in] keepAlive If true the connection is kept open for
+    further requests from the client.
+ */
+void send503(std::ostream& os, const std::string& cmd,
+             bool keepAlive = false) {
+    const std::string msg = "Too many commands running to run: " + cmd;
+    // Send a fixed message back to the client.
+    os << "HTTP/1.1 503 Service Unavailable\r\n"
+       << "Content-Type: text/plain\r\n"
+       << "Retry-After: " << config.retryAfter << "\r\n"
+       << "Transfer-Encoding: chunked\r\n"
+       << "Connection: " << (keepAlive ? "keep-alive" : "Close")
+       << "\r\n\r\n";
+    // Send the chunked data and trailer to end stream to client.
+    os << chunk(msg) << "0\r\n\r\n";
+}
+
+/** Helper method to send HTTP 500 message back to the client.
+
+    This method is called when a command could not be started at all,
+    e.g., because the server ran out of processes or file descriptors.
+
+    \param[out] os The output stream to where the data is to be
+    written.
+
+    \param[in] cmd The command that was not run.
+
+    \param[in] keepAlive If true the connection is kept open for
+    further requests from the client.
+ */
+void send500(std::ostream& os, const std::string& cmd,
+             bool keepAlive = false) {
+    const std::string msg = "Unable to start command: " + cmd;
+    // Send a fixed message back to the client.
+    os << "HTTP/1.1 500 Internal Server Error\r\n"
+       << "Content-Type: text/plain\r\n"
+       << "Transfer-Encoding: chunked\r\n"
+       << "Connection: " << (keepAlive ? "keep-alive" : "Close")
+       << "\r\n\r\n";
+    // Send the chunked data and trailer to end stream to client.
+    os << chunk(msg) << "0\r\n\r\n";
 }
 
 /**
@@ -154,12 +634,326 @@ std::string getMimeType(const std::string& path) {
             return "image/png";
         } else if (ext == "jpg") {
             return "image/jpeg";
+        } else if (ext == "css") {
+            return "text/css";
+        } else if (ext == "js") {
+            return "application/javascript";
+        } else if (ext == "json") {
+            return "application/json";
         }
     }
     // In all cases return default mime type.
     return "text/plain";
 }
 
+/**
+ * Check if data of a mime type is worth compressing.
+ *
+ * @param mimeType The mime type, e.g., "text/html".
+ * @return true for text, such as HTML, CSS, and JavaScript.
+ */
+bool isCompressible(const std::string& mimeType) {
+    return (mimeType.compare(0, 5, "text/") == 0) ||
+        (mimeType == "application/javascript");
+}
+
+/**
+ * Compresses a response body in gzip or deflate (zlib) format as it is
+ * streamed.  Each piece of data is compressed and flushed (with
+ * Z_SYNC_FLUSH) so the client can decompress and show it right away,
+ * while later pieces still benefit from the history of earlier ones.
+ */
+class Compressor {
+public:
+    /**
+     * @param encoding The content-encoding: "gzip" or "deflate".
+     */
+    explicit Compressor(const std::string& encoding) {
+        deflateInit2(&zs, config.gzipLevel, Z_DEFLATED,
+                     (encoding == "gzip" ? 15 + 16 : 15), 8,
+                     Z_DEFAULT_STRATEGY);
+    }
+
+    ~Compressor() {
+        deflateEnd(&zs);
+    }
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    /**
+     * Compress the next piece of the body.
+     *
+     * @param data The data to be compressed.
+     * @param len The number of bytes of data.
+     * @param last If true this is the end of the body.
+     * @return The compressed data, which is never empty.
+     */
+    std::string compress(const char* data, size_t len, bool last = false) {
+        std::string out;
+        zs.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = len;
+        do {
+            const size_t used = out.size(), room = len / 2 + 64;
+            out.resize(used + room);
+            zs.next_out  = reinterpret_cast<Bytef*>(&out[used]);
+            zs.avail_out = room;
+            deflate(&zs, (last ? Z_FINISH : Z_SYNC_FLUSH));
+            out.resize(used + room - zs.avail_out);
+        } while (zs.avail_out == 0);
+        return out;
+    }
+
+    std::string compress(const std::string& data, bool last = false) {
+        return compress(data.data(), data.size(), last);
+    }
+
+private:
+    z_stream zs = {};
+};
+
+/**
+ * Pick the compression for a response from the Accept-Encoding header
+ * of a request, preferring gzip to deflate.  Codings with "q=0" are
+ * not acceptable.
+ *
+ * @param accept The value of the Accept-Encoding header.
+ * @return "gzip", "deflate", or "" for no compression.
+ */
+std::string getEncoding(std::string_view accept) {
+    bool gzip = false, deflate = false;
+    while ((config.gzipLevel > 0) && !accept.empty()) {
+        const size_t comma = accept.find(',');
+        std::string_view coding = accept.substr(0, comma);
+        accept = (comma == std::string_view::npos ? std::string_view() :
+                  accept.substr(comma + 1));
+        const size_t semi = coding.find(';');
+        const bool refused = (semi != std::string_view::npos) &&
+            (coding.find("q=0", semi) != std::string_view::npos) &&
+            (coding.find_first_of("123456789", semi) ==
+             std::string_view::npos);
+        coding = coding.substr(0, semi);
+        while (!coding.empty() && (coding.front() == ' ')) {
+            coding.remove_prefix(1);
+        }
+        while (!coding.empty() && (coding.back() == ' ')) {
+            coding.remove_suffix(1);
+        }
+        gzip    |= !refused && (coding == "gzip");
+        deflate |= !refused && (coding == "deflate");
+    }
+    return (gzip ? "gzip" : (deflate ? "deflate" : ""));
+}
+
+/**
+ * Obtain the HTTP header for a static file.  Files are sent in a single
+ * piece with a Content-Length rather than chunked.
+ * 
+ * @param path The path to the file (used for its mime type).
+ * @param size The size of the file (as sent) in bytes.
+ * @param keepAlive If true the connection is kept open.
+ * @param encoding The content-encoding of the file, if compressed.
+ * @return The HTTP header.
+ */
+std::string fileHeader(const std::string& path, size_t size, bool keepAlive,
+                       const std::string& encoding = "") {
+    return "HTTP/1.1 200 OK\r\nContent-Type: " + getMimeType(path) +
+        (encoding.empty() ? "" : "\r\nContent-Encoding: " + encoding +
+         "\r\nVary: Accept-Encoding") +
+        "\r\nContent-Length: " + std::to_string(size) + "\r\nConnection: " +
+        (keepAlive ? "keep-alive" : "Close") + "\r\n\r\n";
+}
+
+/**
+ * A read-only memory-mapping of a static file.  The mapping is released
+ * when the last shared_ptr to it (held by the cache or by connections
+ * still sending it) goes away.  A gzip-compressed copy of a text file
+ * is kept with it once a client accepting gzip asked for the file.
+ */
+struct MappedFile {
+    MappedFile(int fd, const struct stat& info, const std::string& path) :
+        size(info.st_size), mtime(info.st_mtim), path(path) {
+        if (size > 0) {
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = (addr == MAP_FAILED ? nullptr : static_cast<char*>(addr));
+        }
+        for (const bool keepAlive : {false, true}) {
+            headers[keepAlive] = fileHeader(path, size, keepAlive);
+        }
+    }
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap(data, size);
+        }
+    }
+
+    /** The HTTP header for sending the file, made once with it. */
+    const std::string& header(bool keepAlive) const {
+        return headers[keepAlive];
+    }
+
+    /** The file compressed with gzip, made when first needed. */
+    const std::string& gzipped() {
+        std::call_once(gzipOnce, [this] {
+            gzipData = Compressor("gzip").compress(data, size, true);
+            for (const bool keepAlive : {false, true}) {
+                gzipHeaders[keepAlive] = fileHeader(path, gzipData.size(),
+                                                    keepAlive, "gzip");
+            }
+        });
+        return gzipData;
+    }
+
+    /** The HTTP header for sending the gzipped file. */
+    const std::string& gzipHeader(bool keepAlive) {
+        gzipped();
+        return gzipHeaders[keepAlive];
+    }
+
+    char* data = nullptr;
+    size_t size;
+    struct timespec mtime;
+
+private:
+    const std::string path;
+    std::string headers[2];  // Indexed by keepAlive
+    std::once_flag gzipOnce;
+    std::string gzipData, gzipHeaders[2];
+};
+
+using MappedFilePtr = std::shared_ptr<MappedFile>;
+
+/**
+ * A bounded LRU cache of memory-mapped static files keyed by path.  An
+ * entry is replaced when the file's modification time (or size) on
+ * disk changes.  Least recently used files are evicted to keep the
+ * total size of cached files within config.fileCacheSize.
+ */
+class FileCache {
+public:
+    /**
+     * Obtain a mapping of the file at the given path.  Files larger than
+     * config.maxCachedFile are mapped but not cached.
+     * 
+     * @param path The path to the file.
+     * @param info The current stat information of the file.
+     * @return The mapped file or nullptr if it could not be mapped.
+     */
+    MappedFilePtr get(const std::string& path, const struct stat& info) {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto entry = files.find(path);
+        if (entry != files.end()) {
+            const MappedFilePtr& file = entry->second.first;
+            if ((file->mtime.tv_sec == info.st_mtim.tv_sec) &&
+                (file->mtime.tv_nsec == info.st_mtim.tv_nsec) &&
+                (file->size == static_cast<size_t>(info.st_size))) {
+                // Hit: move to the front of the LRU list.
+                lru.splice(lru.begin(), lru, entry->second.second);
+                return file;
+            }
+            remove(entry);  // Stale: file changed on disk.
+        }
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        MappedFilePtr file = std::make_shared<MappedFile>(fd, info, path);
+        close(fd);
+        if ((file->size > 0) && (file->data == nullptr)) {
+            return nullptr;
+        }
+        if (file->size <= config.maxCachedFile) {
+            lru.push_front(path);
+            files[path] = {file, lru.begin()};
+            used += file->size;
+            while (used > config.fileCacheSize) {
+                remove(files.find(lru.back()));
+            }
+        }
+        return file;
+    }
+
+private:
+    using Entry = std::pair<MappedFilePtr, std::list<std::string>::iterator>;
+
+    void remove(std::unordered_map<std::string, Entry>::iterator entry) {
+        used -= entry->second.first->size;
+        lru.erase(entry->second.second);
+        files.erase(entry);
+    }
+
+    size_t used = 0;
+    std::list<std::string> lru;  // Most recently used path is first.
+    std::unordered_map<std::string, Entry> files;
+    std::mutex cacheMutex;
+};
+
+FileCache fileCache;
+
+/**
+ * Check if a path from a request refers to a regular file under the
+ * current directory that can be served to clients.  Only files with
+ * one of the types in getMimeType (HTML, CSS, scripts, images and
+ * JSON) are served, so that sources, request files, and the history
+ * log in the same directory are not.  Hidden files are not served
+ * either.
+ * 
+ * @param path The path from the GET request.
+ * @param info The stat information for the file is stored here.
+ * @return true if the file can be served.
+ */
+bool getStaticFile(const std::string& path, struct stat& info) {
+    if ((path.find("..") != std::string::npos) || (path[0] == '/')) {
+        return false;  // Do not allow paths outside current directory.
+    }
+    if ((path[0] == '.') || (path.find("/.") != std::string::npos) ||
+        (getMimeType(path) == "text/plain")) {
+        return false;  // Not a type of file that is served.
+    }
+    return (stat(path.c_str(), &info) == 0) && S_ISREG(info.st_mode);
+}
+
+/**
+ * Check if a static file should be sent compressed with gzip.
+ *
+ * @param path The path to the file (used for its mime type).
+ * @param size The size of the file in bytes.
+ * @param encoding The encoding picked for the request by getEncoding.
+ * @return true if the file should be sent compressed.
+ */
+bool gzipFile(const std::string& path, size_t size,
+              const std::string& encoding) {
+    return (encoding == "gzip") && (size >= config.gzipMinSize) &&
+        isCompressible(getMimeType(path));
+}
+
+/**
+ * Send a static file to the client, from the file cache, or a 404 if
+ * the file cannot be served.
+ * 
+ * @param os The output stream to send data to client.
+ * @param path The path to the file.
+ * @param encoding The encoding accepted by the client (see getEncoding).
+ */
+void sendFile(std::ostream& os, const std::string& path,
+              const std::string& encoding) {
+    struct stat info;
+    MappedFilePtr file;
+    if (!getStaticFile(path, info) || !(file = fileCache.get(path, info))) {
+        // Invalid file/File not found. Return 404 error message.
+        metrics.notFoundRequests++;
+        send404(os, path);
+    } else if (gzipFile(path, file->size, encoding)) {
+        metrics.staticRequests++;
+        os << file->gzipHeader(false) << file->gzipped();
+    } else {
+        metrics.staticRequests++;
+        os << file->header(false);
+        os.write(file->data, file->size);
+    }
+}
+
 /** Convenience method to split a given string into words.
 
     This method is just a copy-paste of example code from lecture
@@ -199,254 +993,3560 @@ void runChild(std::vector<std::string> argList) {
     args.push_back(nullptr);
     // Finally run the command in child process
     execvp(args[0], &args[0]);  // Run the command!
-    // If control drops here, then the command was not found!
-    std::cout << "Command " << argList[0] << " not found!\n";
-    // Exit out of child process with error exit code.    
-    exit(0);
-}
-
-/** Helper method to send the data to client in chunks.
-    
-    This method is a helper method that is used to send data to the
-    client line-by-line.
-
-    \param[in] mimeType The Mime Type to be included in the header.
-
-    \param[in] pid An optional PID for the child process.  If it is
-    -1, it is ignored.  Otherwise it is used to determine the exit
-    code of the child process and send it back to the client.
-*/
-void sendData(const std::string& mimeType, int pid,
-              std::istream& is, std::ostream& os, string& html2, thread& t) {
-    // First write the fixed HTTP header.
-    os << "HTTP/1.1 200 OK\r\n" << "Content-Type: " << mimeType << "\r\n"
-       << "Transfer-Encoding: chunked\r\n" << "Connection: Close\r\n\r\n"
-       << html1();
-    // Read line-by line from child-process and write results to
-    // client.
-    std::string line;
-    while (std::getline(is, line)) {
-        // Add required "\n" to terminate the line.
-        line += "\n";
-        // Add size of line in hex
-        os << std::hex << line.size() << "\r\n";
-        // Write the actual data for the line.
-        os << line << "\r\n";
-    }
-    // Check if we need to end out exit code
-    if (pid != -1) {
-        // We are done with the process -- join the statistics thread
-        t.join();
-        // Wait for process to finish and get exit code.
-        int exitCode = 0;
-        waitpid(pid, &exitCode, 0);
-        // std::cout << "Exit code: " << exitCode << std::endl;
-        // Create exit code information and send to client.
-        line = "\r\nExit code: " + std::to_string(exitCode) + "\r\n";
-        os << std::hex << line.size() << "\r\n" << line << "\r\n";
-    }
-    // Send second HTML portion and trailer out to end stream to client.
-    os << html2 << "0\r\n";
-}
-
-// Hardcoded string
-const string html1() {
-    return "156\r\n<html>\r\n  <head>\r\n    <script type='text/javascript' " 
-        "src='https://www.gstatic.com/charts/loader.js'></script>\r\n    " 
-        "<script type='text/javascript' src='/draw_chart.js'></script>\r\n" 
-        "    <link rel='stylesheet' type='text/css' href='/mystyle.css'>" 
-        "\r\n  </head>\r\n\r\n  <body>\r\n    <h3>Output from program</h3>\r\n" 
-        "    <textarea style='width: 700px; height: 200px'>\r\n\r\n";
+    // If control drops here, then the command was not found!  The
+    // message is written directly as std::cout may still hold output
+    // of the parent process that it had not flushed yet.
+    const std::string msg = "Command " + argList[0] + " not found!\n";
+    write(1, msg.data(), msg.size());
+    // Exit out of child process with error exit code.  _exit is used
+    // so the copies of the server's objects (whose threads do not exist
+    // in the child) are not destroyed.
+    _exit(0);
 }
 
 /**
- * Fake-news-method used to count the number of '\r's so they can
- * be removed from the chunk size later
- * @param html2
- * @return 
+ * Set the limits of the child process (in the child, before it execs
+ * the command).  With the CPU time limit it gets SIGXCPU, and SIGKILL
+ * 1 sec later.  A child whose limits cannot be set reports it and
+ * exits rather than run without them.
+ *
+ * @param limits The CPU time and memory limits.  0 means no limit.
  */
-int newLineCount(string& html2) {
-    int count = 0;
-    for (unsigned int i = 0; i < html2.size(); i++) {
-        if (html2[i] == '\r') { count++; }
+void setChildLimits(const ExecLimits& limits) {
+    bool ok = true;
+    if (limits.cpuTime > 0) {
+        const rlimit cpu = {rlim_t(limits.cpuTime), rlim_t(limits.cpuTime + 1)};
+        ok = (setrlimit(RLIMIT_CPU, &cpu) == 0);
     }
-    return count;
-}
-
-/**
- * Returns JSON arrays stored in a string to plot points
- * @param values
- * @return 
- */
-string json(vector<string> values) {
-    string out = ",\r\n";
-    for (auto line : values) {
-        // first element in line is the time, second is utime, third stime,
-        // fourth is memory
-        stringstream stream(line); string time, utime, stime, memory, cpu;
-        stream >> time >> utime >> stime >> memory;
-        // cpu time is user time + system time
-        cpu = strFl(stof(utime) + stof(stime));
-        out += "          [" + time + ", " + cpu + ", " + memory + "]";
-        if (stoul(time) != values.size()) { out += ",\n"; }
+    if (ok && (limits.memory > 0)) {
+        const rlim_t bytes = rlim_t(limits.memory) << 20;
+        const rlimit mem = {bytes, bytes};
+        ok = (setrlimit(RLIMIT_AS, &mem) == 0);
+    }
+    if (!ok) {
+        const std::string msg = std::string("Unable to set limits: ") +
+            strerror(errno) + "\n";
+        write(1, msg.data(), msg.size());
+        _exit(1);
     }
-    return out + "\n";
-}
-
-void html2(int pid, string& html2Str, bool genChart) {
-    vector<string> values; string statistics = getStats(pid, values);
-    // Three constant portions of this chunk of HTML: variable portions may
-    // be in between these constant portions
-    const string first = "     </textarea>\r\n     <h2>Runtime statistics</h2>"
-            "\r\n     <table>\r\n"
-            "       <tr><th>Time (sec)</th><th>User time</th>"
-            "<th>System time</th><th>Memory (KB)</th></tr>";
-    const string middle = "\r\n     </table>\r\n     <div id='chart' style='wi"
-            "dth: 900px; height: 500px'></div>\r\n  </body>\r\n  <script type="
-            "'text/javascript'>\r\n    function getChartData() {\r\n      "
-            "return google.visualization.arrayToDataTable(\r\n        [\r\n"
-            "          ['Time (sec)', 'CPU Usage', 'Memory Usage']";
-    const string last = "        ]\r\n      );\r\n    }\r\n  </script>\r\n"
-            "</html>\r\n"; string jsonStr;
-    // different output when generating a chart
-    if (!genChart) { jsonStr = "\r\n"; } else { jsonStr = json(values); }
-    string html2 = first + statistics + middle + jsonStr +
-            last;
-    // Convert size to hex
-    stringstream sstream;
-    // this fake-news-math is required to get the right chunk size
-    sstream << hex << html2.size() - 17 - newLineCount(statistics);
-    lock_guard<mutex> guard(statMutex);
-    html2Str = sstream.str() + "\r\n" + html2 + "\r\n";
 }
 
 /**
- * Makes the format of the float numbers correct according to the base case
- * expected results, because apparently it's not correct as is
- * @param fl
- * @return 
+ * Body of "--limited-exec cpu mem cmd [args]": the wrapper through which
+ * the posix spawner starts commands with limits, as posix_spawn cannot
+ * set them itself.  The limits are set and then the command is run in
+ * the same process.
+ *
+ * @param argc Number of arguments, at least 5.
+ * @param argv The arguments, starting with "--limited-exec" in argv[1].
  */
-string strFl(float fl) {
-    if (fl == 0) { return "0"; }
-    string orig = to_string(fl);
-    string form = orig.substr(0, orig.find(".") + 3);
-    if (form.substr(form.size()-1) == "0") { 
-        form = form.substr(0, form.size()-1);
-    }
-    return form;
+void runLimited(int argc, char** argv) {
+    ExecLimits limits;
+    limits.cpuTime = std::atoi(argv[2]);
+    limits.memory  = std::atol(argv[3]);
+    setChildLimits(limits);
+    runChild(std::vector<std::string>(argv + 4, argv + argc));
 }
 
 /**
- * Gets a string detailing the runtime statistics 
- * @param pid
- * @return stats
+ * Reads statistics of a process from /proc without allocating memory.
+ * The stat, status, and io files of the process are opened once (when
+ * the process is tracked) and re-read with pread into a fixed buffer
+ * every time a sample is taken.
  */
-string getStats(int pid, vector<string>& values) {
-    string stats = ""; int time = 1, exitCode = 0;
-    while (waitpid(pid, &exitCode, WNOHANG) == 0) {
-        sleep(1);
-        string word, fileName = "/proc/" + to_string(pid) + "/stat";
-        ifstream file(fileName); int wordNum = 1;
-        float userTime, systemTime; long memory;
-        // Extract the 14th, 15th, and 23rd words
-        while (file >> word) {
-            long sys = sysconf(_SC_CLK_TCK);
-            if (wordNum == 14) { userTime = stof(word) / sys; } else if
-                (wordNum == 15) { systemTime = stof(word) / sys; } else if
-                (wordNum == 23) { memory = stol(word) / 1000; }
-            wordNum++;
-        }
-        stats = stats + "\r\n       <tr><td>" + to_string(time) + "</td><td>" + 
-                strFl(userTime) + "</td><td>" + strFl(systemTime) +
-                "</td><td>" + to_string(memory) + "</td></tr>";
-        values.push_back(to_string(time) + " " + strFl(userTime) + " " +
-            strFl(systemTime) + " " + to_string(memory));
-        time++;
+class ProcStatReader {
+public:
+    explicit ProcStatReader(int pid) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        statFd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "/proc/%d/status", pid);
+        statusFd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, sizeof(path), "/proc/%d/io", pid);
+        ioFd = open(path, O_RDONLY | O_CLOEXEC);
     }
-    return stats;
-}
 
-/** Run the specified command and send output back to the user.
+    ProcStatReader(ProcStatReader&& other) : statFd(other.statFd),
+        statusFd(other.statusFd), ioFd(other.ioFd) {
+        other.statFd = other.statusFd = other.ioFd = -1;
+    }
 
-    This method runs the specified command and sends the data back to
-    the client using chunked-style response.
+    ProcStatReader& operator=(ProcStatReader&& other) {
+        std::swap(statFd, other.statFd);
+        std::swap(statusFd, other.statusFd);
+        std::swap(ioFd, other.ioFd);
+        return *this;
+    }
 
-    \param[in] cmd The command to be executed
+    ~ProcStatReader() {
+        for (int fd : {statFd, statusFd, ioFd}) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
 
-    \param[in] args The command-line arguments, wich each one
+    /**
+     * Read the current statistics of the process into a sample.
+     * 
+     * @param sample The sample in which statistics are stored.  Its
+     * time is not changed.
+     * @return true if the statistics could be read.
+     */
+    bool read(StatSample& sample) {
+        static const long ticks = sysconf(_SC_CLK_TCK);
+        static const long pageKB = sysconf(_SC_PAGESIZE) / 1024;
+        // The command name (2nd field) may contain spaces, so fields
+        // are counted from the ')' that ends it.
+        const char* pos = (readFile(statFd) ? strrchr(buf, ')') : nullptr);
+        if (pos == nullptr) {
+            return false;
+        }
+        long fields[25] = {0};
+        for (int field = 3; (field < 25) && (*pos != '\0'); field++) {
+            pos = strchr(pos + 1, ' ');
+            if (pos == nullptr) {
+                return false;
+            }
+            fields[field] = strtol(pos + 1, nullptr, 10);
+        }
+        sample.minorFaults = fields[10];
+        sample.majorFaults = fields[12];
+        sample.userTime    = static_cast<float>(fields[14]) / ticks;
+        sample.systemTime  = static_cast<float>(fields[15]) / ticks;
+        sample.memory      = fields[24] * pageKB;
+        sample.virtualMemory = fields[23] / 1000;
+        readFile(statusFd);
+        sample.volSwitches   = fieldValue("\nvoluntary_ctxt_switches:");
+        sample.involSwitches = fieldValue("\nnonvoluntary_ctxt_switches:");
+        readFile(ioFd);
+        sample.readBytes  = fieldValue("\nread_bytes:");
+        sample.writeBytes = fieldValue("\nwrite_bytes:");
+        return true;
+    }
+
+private:
+    /** Read a whole (small) /proc file into buf.  An unreadable file
+        leaves buf empty so its values are read as 0. */
+    bool readFile(int fd) {
+        const ssize_t len = (fd == -1 ? -1 : pread(fd, buf, sizeof(buf) - 1, 0));
+        buf[std::max<ssize_t>(len, 0)] = '\0';
+        return len > 0;
+    }
+
+    /** Obtain the value of a "\nname: value" line in buf, or 0. */
+    long fieldValue(const char* name) const {
+        const char* pos = strstr(buf, name);
+        return (pos == nullptr ? 0 : strtol(pos + strlen(name), nullptr, 10));
+    }
+
+    int statFd, statusFd, ioFd;
+    char buf[4096];
+};
+
+/**
+ * The samples of a child process, downsampled so that at most
+ * config.maxSamples are kept however long the child runs.  Samples are
+ * kept at full rate until the series is full.  Then adjacent pairs are
+ * merged (halving the series) and from then on each entry combines
+ * twice as many samples as before, and so on.
+ *
+ * A merged entry has the time & (cumulative) CPU times, faults,
+ * context switches, and I/O of the last sample in it, but the peak
+ * memory of all of them, so that peaks in memory are not lost.
+ */
+class SampleSeries {
+public:
+    SampleSeries() {
+        samples.reserve(config.maxSamples);
+    }
+
+    /**
+     * Add a new sample to the series.
+     * 
+     * @param sample The sample just taken.
+     * @param halved Set to true if the series was halved before the
+     * entry completed by this sample was added to it.
+     * @return true if the sample completed an entry, which is then the
+     * last one in the series.  Otherwise the sample is combined with
+     * the following ones into the next entry.
+     */
+    bool add(const StatSample& sample, bool& halved) {
+        if (inBucket++ == 0) {
+            bucket = sample;
+        } else {
+            merge(bucket, sample);
+        }
+        halved = false;
+        if (inBucket < bucketSize) {
+            return false;
+        }
+        if (samples.size() == config.maxSamples) {
+            halve(samples);
+            bucketSize *= 2;
+            halved = true;
+        }
+        samples.push_back(bucket);
+        inBucket = 0;
+        return true;
+    }
+
+    /** The last (complete) entry in the series. */
+    const StatSample& last() const {
+        return samples.back();
+    }
+
+    /** The samples in the series, including a partially filled entry. */
+    std::vector<StatSample> get() const {
+        std::vector<StatSample> all = samples;
+        if (inBucket > 0) {
+            all.push_back(bucket);
+        }
+        return all;
+    }
+
+    /** Merge adjacent pairs of entries (as halveSamples() in
+        draw_chart.js does). */
+    static void halve(std::vector<StatSample>& entries) {
+        for (size_t i = 0; (i < entries.size() / 2); i++) {
+            entries[i] = entries[2 * i];
+            merge(entries[i], entries[2 * i + 1]);
+        }
+        entries.resize(entries.size() / 2);
+    }
+
+private:
+    /** Combine a later sample into an entry of the series. */
+    static void merge(StatSample& entry, const StatSample& later) {
+        const long peak = std::max(entry.memory, later.memory);
+        entry = later;
+        entry.memory = peak;
+    }
+
+    std::vector<StatSample> samples;
+    StatSample bucket;      // The entry being filled
+    int bucketSize = 1;     // Samples combined into each new entry
+    int inBucket = 0;       // Samples in the entry being filled
+};
+
+/**
+ * Obtain the Server-Sent Events for 1 sample of a job: "sample" with
+ * the arguments of addSample() in draw_chart.js as a JSON array,
+ * preceded by "halve" if the samples were halved first.
+ *
+ * @param sample The sample.
+ * @param halved If true, the samples were halved before this one.
+ * @return The text of the events.
+ */
+std::string sampleEvent(const StatSample& sample, bool halved) {
+    return (halved ? "event: halve\ndata:\n\n" : "") +
+        ("event: sample\ndata: [" + sampleArgs(sample) + "]\n\n");
+}
+
+/**
+ * A command run for a cgi-bin/exec request whose statistics can be
+ * watched live, by any number of viewers, via cgi-bin/stream?id=N as
+ * Server-Sent Events.  The sampler publishes each sample to the job
+ * once and the job fans it out to its subscribers, whose callbacks just
+ * queue the events on their connections -- so viewers need no threads
+ * of their own.  The samples published so far are kept (and halved
+ * like the sampler's series) to be replayed to viewers who join late.
+ */
+class Job {
+public:
+    /** Called with events to be sent to a viewer.  last is true for the
+        final "done" event, after which the callback is not used. */
+    using Subscriber = std::function<void(const std::string& events,
+                                          bool last)>;
+
+    explicit Job(long id) : id(id) {}
+
+    /** Send a sample to the viewers. */
+    void publish(const StatSample& sample, bool halved) {
+        std::lock_guard<std::mutex> guard(jobMutex);
+        if (halved) {
+            SampleSeries::halve(samples);
+        }
+        samples.push_back(sample);
+        const std::string event = sampleEvent(sample, halved);
+        for (Subscriber& sub : subscribers) {
+            sub(event, false);
+        }
+    }
+
+    /** Send the exit code to the viewers, ending their streams. */
+    void finish(const ChildResult& result) {
+        std::lock_guard<std::mutex> guard(jobMutex);
+        std::string reason;
+        for (const char c : result.reason) {
+            if ((c == '"') || (c == '\\')) {
+                reason += '\\';  // Escape for JSON
+            }
+            reason += c;
+        }
+        doneEvent = "event: done\ndata: {\"exitCode\": " +
+            std::to_string(result.exitCode) + ", \"reason\": \"" + reason +
+            "\", \"maxRss\": " + std::to_string(result.usage.ru_maxrss) +
+            "}\n\n";
+        for (Subscriber& sub : subscribers) {
+            sub(doneEvent, true);
+        }
+        subscribers.clear();
+    }
+
+    /** Add a viewer: the samples so far are sent to it right away. */
+    void subscribe(Subscriber sub) {
+        std::lock_guard<std::mutex> guard(jobMutex);
+        std::string events;
+        for (const StatSample& sample : samples) {
+            events += sampleEvent(sample, false);
+        }
+        if (!doneEvent.empty()) {
+            sub(events + doneEvent, true);
+            return;
+        }
+        if (!events.empty()) {
+            sub(events, false);
+        }
+        subscribers.push_back(std::move(sub));
+    }
+
+    const long id;
+
+private:
+    std::mutex jobMutex;
+    std::vector<StatSample> samples;
+    std::vector<Subscriber> subscribers;
+    std::string doneEvent;  // Set once the command finished
+};
+
+using JobPtr = std::shared_ptr<Job>;
+
+/**
+ * The jobs that can be watched: all running ones and the last
+ * config.maxJobs that finished.
+ */
+class JobTable {
+public:
+    /** Add a job for a command being started. */
+    JobPtr start() {
+        std::lock_guard<std::mutex> guard(tableMutex);
+        JobPtr job = std::make_shared<Job>(nextId++);
+        jobs[job->id] = job;
+        return job;
+    }
+
+    /** Obtain a job by id or nullptr if there is no such job (now). */
+    JobPtr find(long id) {
+        std::lock_guard<std::mutex> guard(tableMutex);
+        const auto job = jobs.find(id);
+        return (job == jobs.end() ? nullptr : job->second);
+    }
+
+    /** Note that a job finished, forgetting the oldest finished ones. */
+    void finished(long id) {
+        std::lock_guard<std::mutex> guard(tableMutex);
+        done.push_back(id);
+        while (done.size() > config.maxJobs) {
+            jobs.erase(done.front());
+            done.pop_front();
+        }
+    }
+
+private:
+    long nextId = 1;
+    std::unordered_map<long, JobPtr> jobs;
+    std::deque<long> done;  // Ids of finished jobs, oldest first
+    std::mutex tableMutex;
+};
+
+JobTable jobs;
+
+/**
+ * A persistent history of the commands run: each finished run is
+ * appended, with its arguments, exit code, start time, runtime, CPU
+ * time, peak memory, and samples, to a log in a memory-mapped file of
+ * fixed size (--history=path, --history-size=bytes).  The log is a
+ * ring: once it is full, the oldest runs are dropped to make room, so
+ * the file never grows.  The file is only mapped at startup, not
+ * parsed, and its runs are queried right from the mapping.
+ *
+ * The file starts with a header that also holds the index: a hash
+ * table of the commands seen, each with the position of its last run.
+ * Each run links to the previous run of the same command, so the last
+ * N runs of a command are found by following N links, without scanning
+ * the log.  Links to runs that were since dropped are recognized by
+ * their sequence numbers.  A run is written before the header is
+ * updated to include it, so a crash while it is written loses only
+ * that run.
+ */
+class HistoryStore {
+public:
+    ~HistoryStore() {
+        if (base != nullptr) {
+            munmap(base, header()->size);
+        }
+    }
+
+    /**
+     * Map the history file, creating (or resetting) it if it does not
+     * hold a valid history.  An existing history keeps its size.
+     *
+     * @param path The path to the file.
+     * @param size The size of a new file in bytes.
+     * @return true if the history is ready to be used.
+     */
+    bool open(const std::string& path, size_t size) {
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                              0644);
+        if (fd == -1) {
+            return false;
+        }
+        size = std::max(size, sizeof(Header) + MinRecordArea);
+        struct stat info;
+        Header existing = {};
+        const bool valid = (fstat(fd, &info) == 0) &&
+            (size_t(info.st_size) >= sizeof(Header) + MinRecordArea) &&
+            (pread(fd, &existing, sizeof(existing), 0) ==
+             sizeof(existing)) &&
+            (memcmp(existing.magic, Magic, sizeof(Magic)) == 0) &&
+            (existing.size == uint64_t(info.st_size));
+        if (valid) {
+            size = info.st_size;
+        } else if ((ftruncate(fd, 0) != 0) || (ftruncate(fd, size) != 0)) {
+            ::close(fd);
+            return false;
+        }
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        base = static_cast<char*>(addr);
+        capacity = size - sizeof(Header);
+        if (!valid || !check()) {
+            // A new file, or one that was truncated or corrupted.
+            Header* hdr = header();
+            memset(hdr, 0, sizeof(Header));
+            memcpy(hdr->magic, Magic, sizeof(Magic));
+            hdr->size = size;
+            hdr->head = hdr->tail = 0;
+            hdr->nextSeq = hdr->tailSeq = 1;
+        }
+        return true;
+    }
+
+    /** Check if a history file is in use. */
+    bool isOpen() const { return base != nullptr; }
+
+    /**
+     * Add a finished run of a command to the history.
+     *
+     * @param cmd The command.
+     * @param args The arguments of the command.
+     * @param result The exit code, resource usage and samples.
+     */
+    void record(const std::string& cmd, const std::string& args,
+                const ChildResult& result) {
+        if (!isOpen()) {
+            return;
+        }
+        const size_t argsLen = std::min(args.size(), MaxArgs);
+        const size_t textLen = align(cmd.size() + argsLen);
+        const size_t samples = result.samples.size();
+        const size_t size = sizeof(Record) + textLen + samples * sizeof(Point);
+        if ((cmd.size() > MaxArgs) || (size > capacity / 2)) {
+            return;  // Keep room for runs of other commands
+        }
+        std::lock_guard<std::mutex> guard(storeMutex);
+        Header* hdr = header();
+        makeRoom(size);
+        // Write the run, then add it to the index and the log.
+        Record* rec = at(hdr->head);
+        Slot& slot = findSlot(cmd, true);
+        rec->size = size;
+        rec->cmdLen = cmd.size();
+        rec->argsLen = argsLen;
+        rec->samples = samples;
+        rec->seq = hdr->nextSeq;
+        rec->prevOffset = slot.offset;
+        rec->prevSeq = slot.seq;
+        rec->start = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() -
+            result.runTime;
+        rec->exitCode = result.exitCode;
+        rec->runTime = result.runTime;
+        rec->userTime = result.usage.ru_utime.tv_sec +
+            result.usage.ru_utime.tv_usec / 1e6f;
+        rec->systemTime = result.usage.ru_stime.tv_sec +
+            result.usage.ru_stime.tv_usec / 1e6f;
+        rec->maxRss = result.usage.ru_maxrss;
+        char* text = reinterpret_cast<char*>(rec + 1);
+        memcpy(text, cmd.data(), cmd.size());
+        memcpy(text + cmd.size(), args.data(), argsLen);
+        Point* points = reinterpret_cast<Point*>(text + textLen);
+        for (size_t i = 0; (i < samples); i++) {
+            const StatSample& sample = result.samples[i];
+            points[i] = {sample.time, sample.userTime, sample.systemTime,
+                         int32_t(sample.memory)};
+        }
+        slot.offset = hdr->head;
+        slot.seq = rec->seq;
+        slot.runs++;
+        hdr->head += size;
+        hdr->nextSeq++;
+    }
+
+    /**
+     * Obtain the last runs of a command, newest first, with the 50th
+     * and 95th percentile of their runtimes and their peak memory.
+     *
+     * @param cmd The command.
+     * @param count The maximum number of runs.
+     * @return The runs & summary as JSON, for showHistory() in
+     * draw_chart.js.
+     */
+    std::string query(const std::string& cmd, size_t count) {
+        std::lock_guard<std::mutex> guard(storeMutex);
+        const Header* hdr = header();
+        const Slot& slot = findSlot(cmd, false);
+        std::string json = "{\"cmd\": ";
+        appendJson(json, cmd.data(), cmd.size());
+        json += ", \"total\": " + std::to_string(slot.runs) + ", \"runs\": [";
+        std::vector<int> runTimes;
+        long peakMemory = 0;
+        uint64_t offset = slot.offset, seq = slot.seq;
+        for (; (runTimes.size() < count) && (seq >= hdr->tailSeq) &&
+                 (seq < hdr->nextSeq) && (at(offset)->seq == seq);
+             seq = at(offset)->prevSeq, offset = at(offset)->prevOffset) {
+            const Record* rec = at(offset);
+            const char* text = reinterpret_cast<const char*>(rec + 1);
+            json += (runTimes.empty() ? "\n{" : ",\n{");
+            json += "\"start\": " + std::to_string(rec->start) +
+                ", \"args\": ";
+            appendJson(json, text + rec->cmdLen, rec->argsLen);
+            json += ", \"exitCode\": " + std::to_string(rec->exitCode) +
+                ", \"runTime\": " + std::to_string(rec->runTime) +
+                ", \"userTime\": " + strFl(rec->userTime) +
+                ", \"systemTime\": " + strFl(rec->systemTime) +
+                ", \"maxRss\": " + std::to_string(rec->maxRss) +
+                ", \"samples\": [";
+            const Point* points = reinterpret_cast<const Point*>(
+                text + align(rec->cmdLen + rec->argsLen));
+            for (uint32_t i = 0; (i < rec->samples); i++) {
+                json += (i == 0 ? "[" : ", [") +
+                    std::to_string(points[i].time) + ", " +
+                    strFl(points[i].userTime + points[i].systemTime) + ", " +
+                    std::to_string(points[i].memory) + "]";
+            }
+            json += "]}";
+            runTimes.push_back(rec->runTime);
+            peakMemory = std::max<long>(peakMemory, rec->maxRss);
+        }
+        std::sort(runTimes.begin(), runTimes.end());
+        return json + "\n], \"p50\": " + percentile(runTimes, 50) +
+            ", \"p95\": " + percentile(runTimes, 95) + ", \"peakMemory\": " +
+            std::to_string(peakMemory) + "}\n";
+    }
+
+private:
+    /** Number of commands in the index, and bytes of a command name
+        (with its '\0') used to find its entry. */
+    static constexpr size_t IndexSlots = 256, MaxName = 48;
+    /** Longest arguments (or command) kept for a run. */
+    static constexpr size_t MaxArgs = 1024;
+    /** Smallest size of the log. */
+    static constexpr size_t MinRecordArea = 64 * 1024;
+    static constexpr char Magic[8] = "hw7hst1";
+
+    /** An entry in the index: the last run of a command. */
+    struct Slot {
+        char cmd[MaxName];  // "" if the entry is not used
+        uint64_t offset;    // Position of its last run in the log
+        uint64_t seq;       // Sequence number of its last run
+        uint64_t runs;      // Number of runs recorded so far
+    };
+
+    /** The start of the file: where the log starts and ends, and the
+        index.  Positions are relative to the start of the log. */
+    struct Header {
+        char magic[8];
+        uint64_t size;           // Size of the file
+        uint64_t head, tail;     // Where the next run goes & oldest run
+        uint64_t nextSeq;        // Sequence number of the next run
+        uint64_t tailSeq;        // of the oldest run (nextSeq if none)
+        Slot index[IndexSlots];
+    };
+
+    /** A run in the log.  It is followed by the command and arguments
+        (padded to 8 bytes) and then its samples.  A size of 0 marks
+        the end of the log, where it wraps around. */
+    struct Record {
+        uint32_t size, cmdLen, argsLen, samples;
+        uint64_t seq;
+        uint64_t prevOffset, prevSeq;  // Previous run of the command
+        int64_t start;                 // Milliseconds since the epoch
+        int32_t exitCode, runTime;     // runTime is in milliseconds
+        float userTime, systemTime;
+        int64_t maxRss;                // KB
+    };
+
+    /** A sample as kept in the log. */
+    struct Point {
+        int32_t time;
+        float userTime, systemTime;
+        int32_t memory;
+    };
+
+    static size_t align(size_t size) { return (size + 7) & ~size_t(7); }
+
+    Header* header() const { return reinterpret_cast<Header*>(base); }
+
+    Record* at(uint64_t offset) const {
+        return reinterpret_cast<Record*>(base + sizeof(Header) + offset);
+    }
+
+    /**
+     * Check that the log and index of an existing file are consistent,
+     * so that a truncated or corrupt file cannot make runs be read from
+     * outside of the log.  The runs are walked from the oldest to the
+     * newest, as dropOldest would.
+     *
+     * @return true if the head, tail, every run, and every entry of
+     * the index are within the log and refer to runs in it.
+     */
+    bool check() const {
+        const Header* hdr = header();
+        if ((hdr->head > capacity) || (hdr->tail > capacity) ||
+            (hdr->tailSeq > hdr->nextSeq) || (hdr->tailSeq == 0)) {
+            return false;
+        }
+        std::unordered_map<uint64_t, uint64_t> runs;  // Offset -> seq
+        uint64_t offset = hdr->tail, walked = 0;
+        for (uint64_t seq = hdr->tailSeq; (seq < hdr->nextSeq); seq++) {
+            if ((seq != hdr->tailSeq) &&
+                ((offset + sizeof(Record) > capacity) ||
+                 (at(offset)->size == 0))) {
+                offset = 0;  // Wrapped around at the end of the log
+            }
+            if (offset + sizeof(Record) > capacity) {
+                return false;
+            }
+            const Record* rec = at(offset);
+            walked += rec->size;
+            if ((rec->seq != seq) || (rec->size < sizeof(Record)) ||
+                (offset + rec->size > capacity) || (walked > capacity) ||
+                (rec->cmdLen > MaxArgs) || (rec->argsLen > MaxArgs) ||
+                (sizeof(Record) + align(rec->cmdLen + rec->argsLen) +
+                 uint64_t(rec->samples) * sizeof(Point) > rec->size)) {
+                return false;
+            }
+            runs[offset] = seq;
+            offset += rec->size;
+        }
+        if (offset != hdr->head) {
+            return false;  // The newest run does not end at the head
+        }
+        // Links to runs still in the log must refer to those runs.
+        auto refers = [hdr, &runs](uint64_t offset, uint64_t seq) {
+            const auto run = runs.find(offset);
+            return (seq < hdr->tailSeq) || (seq >= hdr->nextSeq) ||
+                ((run != runs.end()) && (run->second == seq));
+        };
+        for (const auto& run : runs) {
+            const Record* rec = at(run.first);
+            if (!refers(rec->prevOffset, rec->prevSeq)) {
+                return false;
+            }
+        }
+        for (const Slot& slot : hdr->index) {
+            if (!memchr(slot.cmd, '\0', MaxName) ||
+                !refers(slot.offset, slot.seq)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** Drop the oldest run from the log. */
+    void dropOldest() {
+        Header* hdr = header();
+        hdr->tail += at(hdr->tail)->size;
+        hdr->tailSeq++;
+        if (hdr->tailSeq == hdr->nextSeq) {
+            hdr->tail = hdr->head;  // Empty
+        } else if ((hdr->tail + sizeof(Record) > capacity) ||
+                   (at(hdr->tail)->size == 0)) {
+            hdr->tail = 0;  // Reached the end of the log
+        }
+    }
+
+    /** Make the head of the log the start of a free space of a given
+        size, wrapping around and dropping the oldest runs as needed. */
+    void makeRoom(size_t size) {
+        Header* hdr = header();
+        auto used = [hdr] { return hdr->tailSeq != hdr->nextSeq; };
+        if (hdr->head + size > capacity) {
+            while (used() && (hdr->tail >= hdr->head)) {
+                dropOldest();  // Runs between the head and the end
+            }
+            if (hdr->head + sizeof(Record) <= capacity) {
+                at(hdr->head)->size = 0;
+            }
+            hdr->head = 0;
+            if (!used()) {
+                hdr->tail = 0;
+            }
+        }
+        while (used() && (hdr->tail >= hdr->head) &&
+               (hdr->tail < hdr->head + size)) {
+            dropOldest();
+        }
+    }
+
+    /**
+     * Find the entry of a command in the index.  A new entry replaces
+     * the entry whose last run is the oldest once the index is full.
+     *
+     * @param cmd The command.
+     * @param add If true, an entry is added if there is none.
+     * @return The entry, or an unused one if there is none and add is
+     * false.
+     */
+    Slot& findSlot(const std::string& cmd, bool add) {
+        static Slot none = {};
+        const std::string name = cmd.substr(0, MaxName - 1);
+        Slot* index = header()->index;
+        Slot* oldest = nullptr;
+        size_t pos = std::hash<std::string>()(name) % IndexSlots;
+        for (size_t i = 0; (i < IndexSlots); i++) {
+            Slot& slot = index[(pos + i) % IndexSlots];
+            if (slot.cmd == name) {
+                return slot;
+            } else if (slot.cmd[0] == '\0') {
+                oldest = &slot;
+                break;
+            } else if (!oldest || (slot.seq < oldest->seq)) {
+                oldest = &slot;
+            }
+        }
+        if (!add) {
+            return none;
+        }
+        *oldest = Slot();
+        memcpy(oldest->cmd, name.data(), name.size());
+        return *oldest;
+    }
+
+    /** The p-th percentile (nearest rank) of sorted runtimes, or
+        "null" if there are none. */
+    static std::string percentile(const std::vector<int>& sorted, int p) {
+        if (sorted.empty()) {
+            return "null";
+        }
+        const size_t rank = (sorted.size() * p + 99) / 100;
+        return std::to_string(sorted[std::max<size_t>(rank, 1) - 1]);
+    }
+
+    /** Append text as a JSON string. */
+    static void appendJson(std::string& out, const char* data, size_t len) {
+        out += '"';
+        for (size_t i = 0; (i < len); i++) {
+            const unsigned char c = data[i];
+            if ((c == '"') || (c == '\\')) {
+                out += '\\';
+                out += c;
+            } else if (c < ' ') {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                out += code;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    char* base = nullptr;  // The mapping of the file
+    size_t capacity = 0;   // Size of the log in bytes
+    std::mutex storeMutex;
+};
+
+constexpr char HistoryStore::Magic[8];
+
+HistoryStore history;
+
+/**
+ * A single thread that manages all running child processes: it samples
+ * their statistics and reaps them.  Each child is sampled every
+ * config.sampleInterval ms, counted from when it was started.
+ *
+ * Children are watched with a pidfd in an epoll set, so the thread
+ * wakes up as soon as one exits (or a sample or deadline is due) and
+ * reaps it -- with its resource usage -- exactly once.  No other code
+ * waits for children.  If pidfds are not supported, a child is instead
+ * checked at each sample and every few ms once its output has closed.
+ *
+ * A child tracked in lockstep (for the offline pages) is instead only
+ * reaped when it is started or right after a sample, as the original
+ * server did: it is sampled every interval until it is reaped, so the
+ * last sample is of the child after it exited.  Its samples are taken
+ * a little after each interval, so that a child exiting at (about) a
+ * whole number of intervals, such as "sleep 3", always has the same
+ * samples.
+ *
+ * A child that runs past its time limit is killed.
+ *
+ * Samples are kept in a SampleSeries, so memory used does not grow with
+ * the time a command runs.  Each entry added to the series is handed to
+ * the child's sample callback as soon as it is complete.  A child that
+ * has exited is reaped and its exit code, resource usage and samples
+ * are handed to the callback given when it was tracked.
+ */
+class StatsSampler {
+public:
+    using Callback = std::function<void(ChildResult&)>;
+    /** Called with each entry added to a series and whether the series
+        was halved before it was added (see SampleSeries::add). */
+    using SampleCallback = std::function<void(const StatSample&, bool)>;
+    using Clock = std::chrono::steady_clock;
+
+    ~StatsSampler() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stop = true;
+        }
+        wake();
+        if (thread.joinable()) {
+            thread.join();
+            close(epollFd);
+            close(wakeFd);
+        }
+    }
+
+    /**
+     * Start tracking a child process that has just been started.
+     * 
+     * @param pid The PID of the child process.
+     * @param done The callback to be called (from the sampler's
+     * thread) once the child has exited.
+     * @param onSample The optional callback to be called (from the
+     * sampler's thread) with each entry added to the child's series of
+     * samples, before done is called.
+     * @param limits The limits of the child: it is killed when it runs
+     * past its timeout.  The others are only used to report why it was
+     * terminated.
+     * @param lockstep If true, the child is only reaped right after a
+     * sample, so that its samples do not depend on timing.
+     */
+    void track(int pid, Callback done, SampleCallback onSample = nullptr,
+               const ExecLimits& limits = ExecLimits(),
+               bool lockstep = false) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (!thread.joinable()) {
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+            wakeFd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            watch(wakeFd, 0);
+            thread = std::thread(&StatsSampler::run, this);
+        }
+        const Clock::time_point now = Clock::now();
+        const Clock::time_point deadline = (limits.timeout == 0 ?
+            Clock::time_point::max() : now + std::chrono::seconds(
+                limits.timeout));
+        const int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd != -1) {
+            fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+            watch(pidfd, pid);
+        }
+        // A child in lockstep is first checked (but not sampled) at 0.
+        children.push_back({pid, pidfd, false, now,
+                            now + (lockstep ? Clock::duration::zero() :
+                                   interval()), false,
+                            now, {}, std::move(done), std::move(onSample),
+                            ProcStatReader(pid), SampleSeries(), limits,
+                            deadline, false, lockstep});
+        wake();
+    }
+
+    /**
+     * Let the sampler know that a child has closed its output, which
+     * usually means that it is about to exit.  This is only needed
+     * when the child could not be watched with a pidfd.
+     * 
+     * @param pid The PID of the child process.
+     */
+    void outputClosed(int pid) {
+        std::lock_guard<std::mutex> guard(mutex);
+        for (Child& child : children) {
+            if (child.pid == pid) {
+                child.closed = true;
+                child.nextCheck = Clock::now();
+            }
+        }
+        wake();
+    }
+
+private:
+    struct Child {
+        int pid;
+        int pidfd;      // -1 if pidfds are not supported
+        bool exited;    // The pidfd reported that it exited
+        Clock::time_point start, nextSample;
+        bool closed;
+        Clock::time_point nextCheck;  // Only used once output is closed
+        ChildResult result;
+        Callback done;
+        SampleCallback onSample;
+        ProcStatReader stats;
+        SampleSeries series;
+        ExecLimits limits;
+        Clock::time_point deadline;
+        bool timedOut;
+        bool lockstep;  // Only reaped right after a sample
+    };
+
+    static Clock::duration interval() {
+        return std::chrono::milliseconds(config.sampleInterval);
+    }
+
+    /** The time at which the next sample of a child is taken. */
+    static Clock::time_point sampleTime(const Child& child) {
+        return child.nextSample + (child.lockstep ? interval() / 10 :
+                                   Clock::duration::zero());
+    }
+
+    /** Add a file descriptor to the epoll set, tagged with a PID (or 0
+        for the eventfd used to wake up the thread). */
+    void watch(int fd, int pid) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = pid;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    /** Wake up the thread to look at the children again. */
+    void wake() {
+        const uint64_t one = 1;
+        if (wakeFd != -1) {
+            ::write(wakeFd, &one, sizeof(one));
+        }
+    }
+
+    /** Describe why a child that has exited was terminated (if it was). */
+    static std::string terminationReason(const Child& child) {
+        const int status = child.result.exitCode;
+        if (child.timedOut) {
+            return "Exceeded time limit of " +
+                std::to_string(child.limits.timeout) + " sec";
+        } else if (!WIFSIGNALED(status)) {
+            return "";
+        } else if (WTERMSIG(status) == SIGXCPU) {
+            return "Exceeded CPU time limit of " +
+                std::to_string(child.limits.cpuTime) + " sec";
+        }
+        return "Killed by signal " + std::to_string(WTERMSIG(status)) +
+            " (" + strsignal(WTERMSIG(status)) + ")";
+    }
+
+    /** The earliest time at which any child needs to be looked at. */
+    Clock::time_point nextWakeup() const {
+        Clock::time_point wakeup = Clock::time_point::max();
+        for (const Child& child : children) {
+            wakeup = std::min(wakeup, sampleTime(child));
+            if ((child.pidfd == -1) && child.closed && !child.lockstep) {
+                wakeup = std::min(wakeup, child.nextCheck);
+            }
+            if (!child.timedOut) {
+                wakeup = std::min(wakeup, child.deadline);
+            }
+        }
+        return wakeup;
+    }
+
+    /** Wait (without holding the lock) for a child to exit or until the
+        next time any child needs to be looked at. */
+    void waitForEvents(std::unique_lock<std::mutex>& lock) {
+        using namespace std::chrono;
+        const Clock::time_point wakeup = nextWakeup();
+        int timeout = -1;
+        if (wakeup != Clock::time_point::max()) {
+            // Round up, so as not to wake up just before the time.
+            timeout = std::max<long>(0, duration_cast<milliseconds>(
+                wakeup - Clock::now() + milliseconds(1) -
+                nanoseconds(1)).count());
+        }
+        lock.unlock();
+        epoll_event events[64];
+        const int count = epoll_wait(epollFd, events, 64, timeout);
+        lock.lock();
+        for (int i = 0; (i < count); i++) {
+            const int pid = events[i].data.u64;
+            if (pid == 0) {
+                uint64_t wakeups;
+                ::read(wakeFd, &wakeups, sizeof(wakeups));
+                continue;
+            }
+            for (Child& child : children) {
+                if ((child.pid == pid) && child.lockstep) {
+                    // Stop watching it until it is reaped at a sample.
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, child.pidfd, nullptr);
+                }
+                child.exited |= (child.pid == pid);
+            }
+        }
+    }
+
+    /** Take the sample of a child that is due, and add it to the list
+        of samples to be handed to sample callbacks. */
+    void takeSample(Child& child, std::vector<std::tuple<SampleCallback,
+                    StatSample, bool>>& added) {
+        StatSample sample;
+        sample.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+            child.nextSample - child.start).count();
+        bool halved;
+        if (child.stats.read(sample) && child.series.add(sample, halved) &&
+            child.onSample) {
+            added.emplace_back(child.onSample, child.series.last(), halved);
+        }
+        child.nextSample += interval();
+    }
+
+    /** Body of the sampler thread. */
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop) {
+            waitForEvents(lock);
+            const Clock::time_point now = Clock::now();
+            std::vector<Child> finished;
+            std::vector<std::tuple<SampleCallback, StatSample, bool>> added;
+            for (auto child = children.begin(); child != children.end();) {
+                const bool sampleDue = (sampleTime(*child) <= now);
+                const bool check = (child->lockstep ? sampleDue :
+                    child->pidfd != -1 ? child->exited :
+                    sampleDue || (child->closed && child->nextCheck <= now));
+                if (sampleDue && child->lockstep) {
+                    if (child->nextSample == child->start) {
+                        child->nextSample += interval();
+                    } else {
+                        takeSample(*child, added);
+                    }
+                }
+                if (check && (wait4(child->pid, &child->result.exitCode,
+                        WNOHANG, &child->result.usage) == child->pid)) {
+                    if (child->pidfd != -1) {
+                        close(child->pidfd);
+                    }
+                    metrics.activeChildren--;
+                    child->result.samples = child->series.get();
+                    child->result.reason = terminationReason(*child);
+                    child->result.runTime = std::chrono::duration_cast<
+                        std::chrono::milliseconds>(now - child->start).count();
+                    finished.push_back(std::move(*child));
+                    child = children.erase(child);
+                    continue;
+                }
+                if (sampleDue && !child->lockstep) {
+                    takeSample(*child, added);
+                }
+                if (!child->timedOut && (child->deadline <= now)) {
+                    kill(child->pid, SIGKILL);
+                    child->timedOut = true;
+                    child->closed = true;  // Check often till it is gone
+                }
+                child->nextCheck = now + std::chrono::milliseconds(2);
+                child++;
+            }
+            // Hand over results without holding the lock
+            lock.unlock();
+            for (auto& entry : added) {
+                std::get<0>(entry)(std::get<1>(entry), std::get<2>(entry));
+            }
+            for (Child& child : finished) {
+                child.done(child.result);
+            }
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::thread thread;
+    int epollFd = -1;
+    int wakeFd  = -1;   // eventfd to wake up the thread
+    std::vector<Child> children;
+    bool stop = false;
+};
+
+StatsSampler sampler;
+
+/**
+ * Relays output from a child process's pipe to a chunked response.  The
+ * pipe is read in large blocks which are coalesced into chunks of up to
+ * config.chunkSize bytes.  A partially filled chunk is sent once its
+ * first byte is config.flushDelay milliseconds old, so output from
+ * interactive commands is still streamed promptly.  With a content
+ * encoding, each chunk is compressed (and flushed) as it is sent.
+ *
+ * Other chunks (such as statistics) may be sent from other threads with
+ * send() while the output is being relayed.
+ */
+class ChunkWriter {
+public:
+    /**
+     * @param fd The pipe from which output is read.
+     * @param os The stream to which chunks are written.
+     * @param escape If true, the output is escaped to be shown as text
+     * in an HTML page.
+     * @param encoding The content-encoding ("gzip" or "deflate") with
+     * which chunks are compressed or "" to send them as they are.
+     */
+    ChunkWriter(int fd, std::ostream& os, bool escape = false,
+                const std::string& encoding = "") : fd(fd), os(os),
+        escape(escape), buf(config.chunkSize) {
+        if (!encoding.empty()) {
+            gzip = std::make_unique<Compressor>(encoding);
+        }
+    }
+
+    /** Relay output until the child process closes its end of the pipe. */
+    void relay() {
+        using namespace std::chrono;
+        steady_clock::time_point deadline;
+        while (true) {
+            int timeout = -1;  // Nothing pending: wait for data.
+            if (len > 0) {
+                timeout = std::max<long>(0, duration_cast<milliseconds>(
+                    deadline - steady_clock::now()).count());
+            }
+            pollfd pfd = {fd, POLLIN, 0};
+            const int ready = poll(&pfd, 1, timeout);
+            if (ready == 0) {
+                flush();  // Deadline reached with a partial chunk.
+                continue;
+            }
+            const ssize_t count = read(fd, &buf[len], buf.size() - len);
+            if (count == -1 && errno == EINTR) {
+                continue;
+            } else if (count <= 0) {
+                break;
+            }
+            if (len == 0) {
+                deadline = steady_clock::now() +
+                    milliseconds(config.flushDelay);
+            }
+            len += count;
+            if (len == buf.size()) {
+                flush();
+            }
+        }
+        flush();
+    }
+
+    /** Also keep a copy of the output relayed, up to 1 byte more than
+        config.maxCachedOutput (to tell if it was too large to cache). */
+    void capture(std::string* out) {
+        captured = out;
+    }
+
+    /** Send data as 1 chunk, between chunks of relayed output.  The
+        last chunk (before the 0-size one) ends the compressed data. */
+    void send(const std::string& data, bool last = false) {
+        std::lock_guard<std::mutex> guard(mutex);
+        os << chunk(gzip ? gzip->compress(data, last) : data) << std::flush;
+    }
+
+private:
+    /** Send the pending data as 1 chunk. */
+    void flush() {
+        if (len == 0) {
+            return;
+        }
+        if (captured && (captured->size() <= config.maxCachedOutput)) {
+            captured->append(&buf[0], std::min(len, config.maxCachedOutput +
+                                               1 - captured->size()));
+        }
+        if (escape) {
+            std::string text;
+            appendEscaped(text, &buf[0], len);
+            send(text);
+        } else if (gzip) {
+            send(std::string(&buf[0], len));
+        } else {
+            std::lock_guard<std::mutex> guard(mutex);
+            os << chunkHeader(len);
+            os.write(&buf[0], len) << "\r\n";
+            os.flush();
+        }
+        len = 0;
+    }
+
+    const int fd;
+    std::ostream& os;
+    const bool escape;
+    std::vector<char> buf;
+    size_t len = 0;
+    std::unique_ptr<Compressor> gzip;
+    std::string* captured = nullptr;
+    std::mutex mutex;  // Serializes writes to os
+};
+
+/** Helper method to send the output of a child process to the client.
+    
+    This method is a helper method that is used to send data to the
+    client in chunks, followed by the exit code and statistics of the
+    child process once it has finished.  It is used by the offline
+    (functional testing) modes, so the page keeps the original layout
+    of the base case expected outputs.
+
+    \param[in] mimeType The Mime Type to be included in the header.
+
+    \param[in] pid The PID of the child process.  Its statistics are
+    collected by the sampler and its exit code sent back to the client.
+
+    \param[in] fd The pipe from which output of the child is read.
+
+    \param[in] genChart If this flag is true then generate data for chart.
+
+    \param[in] limits The limits of the child process, used to kill it
+    when it runs too long.
+
+    \param[out] capture If not nullptr, the output and result of the
+    child are also kept here for the CommandCache.
+
+    \return The exit code, resource usage and samples of the child.
+*/
+ChildResult sendData(const std::string& mimeType, int pid, int fd,
+              std::ostream& os, bool genChart, const ExecLimits& limits,
+              CachedResult* capture) {
+    // Have the sampler collect statistics until the child exits.
+    std::promise<ChildResult> done;
+    std::future<ChildResult> result = done.get_future();
+    sampler.track(pid, [&done](ChildResult& res) {
+        done.set_value(std::move(res));
+    }, nullptr, limits, true);
+    // First write the fixed HTTP header.
+    os << "HTTP/1.1 200 OK\r\n" << "Content-Type: " << mimeType << "\r\n"
+       << "Transfer-Encoding: chunked\r\n" << "Connection: Close\r\n\r\n"
+       << chunk(classicHtml1());
+    // Read blocks from child-process and write results to client.
+    ChunkWriter writer(fd, os);
+    writer.capture(capture ? &capture->output : nullptr);
+    writer.relay();
+    close(fd);
+    sampler.outputClosed(pid);
+    // Wait for process to finish, then send exit code & statistics.
+    const ChildResult res = result.get();
+    if (capture) {
+        capture->result = res;
+    }
+    os << classicHtml2(res, genChart) << "0\r\n\r\n";
+    return res;
+}
+
+/**
+ * The start of the page showing the output of a command: the runtime
+ * statistics table and chart (filled in by the addSample() calls in
+ * draw_chart.js as samples are streamed) and the element in which the
+ * output is shown.
+ * 
+ * @param genChart If true, a chart is shown in addition to the table.
+ * @param jobId If not 0, a link to watch the job's statistics live
+ * (from another browser) is shown.
+ * @return The HTML up to the output of the command.
+ */
+string html1(bool genChart, long jobId) {
+    return html1Start(genChart) + jobLink(jobId) + html1End();
+}
+
+/**
+ * The part of html1 up to the (optional) chart.
+ * 
+ * @param genChart If true, a chart is shown in addition to the table.
+ * @return The HTML up to the job link.
+ */
+string html1Start(bool genChart) {
+    return "<html>\r\n  <head>\r\n    <script type='text/javascript' "
+        "src='https://www.gstatic.com/charts/loader.js'></script>\r\n    "
+        "<script type='text/javascript' src='/draw_chart.js'></script>\r\n"
+        "    <link rel='stylesheet' type='text/css' href='/mystyle.css'>"
+        "\r\n  </head>\r\n\r\n  <body>\r\n    <h2>Runtime statistics</h2>"
+        "\r\n    <table id='stats'>\r\n"
+        "      <tr><th>Time (sec)</th><th>User time</th>"
+        "<th>System time</th><th>Memory (RSS KB)</th>"
+        "<th>Page faults (minor / major)</th>"
+        "<th>Context switches (voluntary / involuntary)</th>"
+        "<th>Disk read (KB)</th><th>Disk write (KB)</th></tr>\r\n"
+        "    </table>\r\n" + string(genChart ? "    <div id='chart' "
+        "style='width: 900px; height: 500px'></div>\r\n" : "");
+}
+
+/**
+ * The link to watch a job live, in html1.
+ * 
+ * @param jobId The id of the job or 0 for no link.
+ * @return The HTML of the link.
+ */
+string jobLink(long jobId) {
+    return (jobId == 0 ? "" : "    <p><a href='/watch.html?id=" +
+            to_string(jobId) + "' target='_blank'>Watch job " +
+            to_string(jobId) + " live</a></p>\r\n");
+}
+
+/**
+ * The part of html1 after the job link, up to the output.
+ * 
+ * @return The HTML starting the output of the command.
+ */
+string html1End() {
+    return "    <h3>Output from program</h3>\r\n    <pre>\r\n";
+}
+
+/**
+ * The end of the page showing the output of a command.
+ * 
+ * @param result The exit code, why the command was terminated (if it
+ * was), and its total resource usage.
+ * @return The HTML after the output of the command.
+ */
+string html2(const ChildResult& result) {
+    const rusage& usage = result.usage;
+    return "\r\nExit code: " + to_string(result.exitCode) + "\r\n" +
+        (result.reason.empty() ? "" : "Terminated: " + result.reason +
+         "\r\n") + "CPU time: " + strFl(usage.ru_utime.tv_sec +
+         usage.ru_utime.tv_usec / 1e6f) + " sec user, " +
+        strFl(usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6f) +
+        " sec system; Max memory (RSS): " + to_string(usage.ru_maxrss) +
+        " KB\r\n    </pre>\r\n  </body>\r\n</html>\r\n";
+}
+
+/**
+ * Format the time of a sample in seconds: whole seconds are shown
+ * without decimals (as in the base case expected results).
+ * @param ms Time in milliseconds
+ * @return 
+ */
+string formatTime(int ms) {
+    return (ms % 1000 == 0 ? to_string(ms / 1000) : strFl(ms / 1000.0f));
+}
+
+/**
+ * The start of the page in the original layout, up to the output of
+ * the command (which is shown in a textarea).
+ * 
+ * @return The HTML, to be sent as 1 chunk.
+ */
+string classicHtml1() {
+    return "<html>\r\n  <head>\r\n    <script type='text/javascript' "
+        "src='https://www.gstatic.com/charts/loader.js'></script>\r\n    "
+        "<script type='text/javascript' src='/draw_chart.js'></script>\r\n"
+        "    <link rel='stylesheet' type='text/css' href='/mystyle.css'>"
+        "\r\n  </head>\r\n\r\n  <body>\r\n    <h3>Output from program</h3>\r\n"
+        "    <textarea style='width: 700px; height: 200px'>\r\n\r\n";
+}
+
+/**
+ * Returns JSON arrays stored in a string to plot points
+ * @param samples
+ * @return 
+ */
+string json(const vector<StatSample>& samples) {
+    string out = ",\r\n";
+    for (size_t i = 0; i < samples.size(); i++) {
+        const StatSample& sample = samples[i];
+        // cpu time is user time + system time
+        const string cpu = strFl(sample.userTime + sample.systemTime);
+        out += "          [" + formatTime(sample.time) + ", " + cpu + ", " +
+            to_string(sample.virtualMemory) + "]";
+        if (i + 1 != samples.size()) { out += ",\n"; }
+    }
+    return out + "\n";
+}
+
+/**
+ * Gets a string with the rows of the runtime statistics table
+ * @param samples
+ * @return stats
+ */
+string getStats(const vector<StatSample>& samples) {
+    string stats = "";
+    for (const StatSample& sample : samples) {
+        stats += "\r\n       <tr><td>" + formatTime(sample.time) +
+            "</td><td>" + strFl(sample.userTime) + "</td><td>" +
+            strFl(sample.systemTime) + "</td><td>" +
+            to_string(sample.virtualMemory) + "</td></tr>";
+    }
+    return stats;
+}
+
+/**
+ * The end of the page in the original layout: the exit code, then the
+ * runtime statistics table and the data of the chart.
+ * 
+ * @param result The exit code and samples of the command.
+ * @param genChart If true, the data for the chart is included.
+ * @return The chunks after the output of the command.
+ */
+string classicHtml2(const ChildResult& result, bool genChart) {
+    const string statistics = getStats(result.samples);
+    // Three constant portions of this chunk of HTML: variable portions may
+    // be in between these constant portions
+    const string first = "     </textarea>\r\n     <h2>Runtime statistics</h2>"
+            "\r\n     <table>\r\n"
+            "       <tr><th>Time (sec)</th><th>User time</th>"
+            "<th>System time</th><th>Memory (KB)</th></tr>";
+    const string middle = "\r\n     </table>\r\n     <div id='chart' style='wi"
+            "dth: 900px; height: 500px'></div>\r\n  </body>\r\n  <script type="
+            "'text/javascript'>\r\n    function getChartData() {\r\n      "
+            "return google.visualization.arrayToDataTable(\r\n        [\r\n"
+            "          ['Time (sec)', 'CPU Usage', 'Memory Usage']";
+    const string last = "        ]\r\n      );\r\n    }\r\n  </script>\r\n"
+            "</html>\r\n"; string jsonStr;
+    // different output when generating a chart
+    if (!genChart) { jsonStr = "\r\n"; }
+    else { jsonStr = json(result.samples); }
+    return chunk("\r\nExit code: " + to_string(result.exitCode) + "\r\n") +
+        chunk(first + statistics + middle + jsonStr + last);
+}
+
+/**
+ * Returns a script adding 1 sample to the runtime statistics table and
+ * chart of the page, to be sent while the command is still running.
+ * @param sample
+ * @param halved If true, the samples shown are halved first, the same
+ * way the sampler halved its series (see SampleSeries).
+ * @return The script element calling addSample() in draw_chart.js
+ */
+string sampleScript(const StatSample& sample, bool halved) {
+    return string("<script>") + (halved ? "halveSamples(); " : "") +
+        "addSample(" + sampleArgs(sample) + ")</script>";
+}
+
+/**
+ * Returns the arguments of addSample() in draw_chart.js for a sample.
+ * @param sample
+ * @return The comma-separated arguments
+ */
+string sampleArgs(const StatSample& sample) {
+    return formatTime(sample.time) + ", " + strFl(sample.userTime) + ", " +
+        strFl(sample.systemTime) + ", " + to_string(sample.memory) + ", " +
+        to_string(sample.minorFaults) + ", " +
+        to_string(sample.majorFaults) + ", " +
+        to_string(sample.volSwitches) + ", " +
+        to_string(sample.involSwitches) + ", " +
+        to_string(sample.readBytes / 1024) + ", " +
+        to_string(sample.writeBytes / 1024);
+}
+
+/**
+ * Append output of a command to a string, escaping the characters that
+ * have a special meaning in HTML so that it is shown as is.
+ * @param out The string to which the escaped text is appended.
+ * @param data The output of the command.
+ * @param len The number of bytes of output.
+ */
+void appendEscaped(std::string& out, const char* data, size_t len) {
+    out.reserve(out.size() + len);
+    for (size_t i = 0; i < len; i++) {
+        switch (data[i]) {
+        case '&': out += "&amp;";  break;
+        case '<': out += "&lt;";   break;
+        case '>': out += "&gt;";   break;
+        default:  out += data[i];
+        }
+    }
+}
+
+/**
+ * Makes the format of the float numbers correct according to the base case
+ * expected results, because apparently it's not correct as is
+ * @param fl
+ * @return 
+ */
+string strFl(float fl) {
+    if (fl == 0) { return "0"; }
+    string orig = to_string(fl);
+    string form = orig.substr(0, orig.find(".") + 3);
+    if (form.substr(form.size()-1) == "0") { 
+        form = form.substr(0, form.size()-1);
+    }
+    return form;
+}
+
+/**
+ * Starts child processes with their std::cout tied to a given file
+ * descriptor.  The spawner used is chosen with --spawner=name.
+ */
+class Spawner {
+public:
+    virtual ~Spawner() {}
+
+    /**
+     * Start a command.
+     * 
+     * @param argList The command-line arguments.  The 1st entry is the
+     * command to be executed.
+     * @param outFd The file descriptor to be used as std::cout of the
+     * command.
+     * @param limits The CPU time and memory limits of the command,
+     * which are set before it is exec'd.
+     * @return The PID of the child process or -1 if the command could
+     * not be started.
+     */
+    virtual int spawn(const std::vector<std::string>& argList, int outFd,
+                      const ExecLimits& limits) = 0;
+};
+
+/**
+ * The classic way: fork and exec in the child.  Forking copies the page
+ * tables of the whole server, so it gets slower as the server grows.
+ */
+class ForkSpawner : public Spawner {
+public:
+    int spawn(const std::vector<std::string>& argList, int outFd,
+              const ExecLimits& limits) override {
+        const int pid = fork();
+        if (pid == 0) {
+            dup2(outFd, 1);     // Tie/redirect std::cout of command
+            setChildLimits(limits);
+            runChild(argList);
+        }
+        return pid;
+    }
+};
+
+/**
+ * Uses posix_spawnp, which (in glibc) shares the memory of the server
+ * with the child until it execs, like vfork, so its cost does not
+ * depend on the size of the server.  The redirection of std::cout is
+ * set up as a file action.  posix_spawn cannot set resource limits, so
+ * a command with limits is started through this program (as
+ * "--limited-exec"), which sets them before it execs the command.
+ */
+class PosixSpawner : public Spawner {
+public:
+    int spawn(const std::vector<std::string>& argList, int outFd,
+              const ExecLimits& limits) override {
+        std::vector<std::string> wrapper;
+        if ((limits.cpuTime > 0) || (limits.memory > 0)) {
+            wrapper = {"/proc/self/exe", "--limited-exec",
+                       std::to_string(limits.cpuTime),
+                       std::to_string(limits.memory)};
+        }
+        std::vector<char*> args;
+        for (const std::string& arg : wrapper) {
+            args.push_back(const_cast<char*>(arg.c_str()));
+        }
+        for (const std::string& arg : argList) {
+            args.push_back(const_cast<char*>(arg.c_str()));
+        }
+        args.push_back(nullptr);
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, outFd, 1);
+        pid_t pid;
+        const int err = posix_spawnp(&pid, args[0], &actions, nullptr,
+                                     &args[0], environ);
+        posix_spawn_file_actions_destroy(&actions);
+        return (err == 0 ? pid : -1);
+    }
+};
+
+/**
+ * Delegates starting commands to a small helper process (a "zygote")
+ * forked when the spawner is created, before the server has grown, so
+ * its forks stay cheap.  Commands are sent to it over a socket, along
+ * with the file descriptor for their std::cout.
+ *
+ * The helper clones the commands with CLONE_PARENT, so that they are
+ * children of the server, which waits for (and samples) them like any
+ * other child.
+ */
+class ZygoteSpawner : public Spawner {
+public:
+    ZygoteSpawner() {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds);
+        helper = fork();
+        if (helper == 0) {
+            close(fds[0]);
+            serve(fds[1]);
+        }
+        close(fds[1]);
+        sock = fds[0];
+    }
+
+    ~ZygoteSpawner() {
+        close(sock);  // The helper exits when the socket is closed.
+        waitpid(helper, nullptr, 0);
+    }
+
+    int spawn(const std::vector<std::string>& argList, int outFd,
+              const ExecLimits& limits) override {
+        // The limits are sent first, followed by the arguments as
+        // consecutive '\0'-terminated strings.
+        std::string msg(reinterpret_cast<const char*>(&limits),
+                        sizeof(limits));
+        for (const std::string& arg : argList) {
+            msg.append(arg.c_str(), arg.size() + 1);
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        int pid = -1;
+        if (!sendWithFd(sock, msg, outFd) ||
+            (recv(sock, &pid, sizeof(pid), 0) != sizeof(pid))) {
+            return -1;
+        }
+        return pid;
+    }
+
+private:
+    /** Send a message along with a file descriptor. */
+    static bool sendWithFd(int sock, const std::string& msg, int fd) {
+        iovec iov = {const_cast<char*>(msg.data()), msg.size()};
+        char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr hdr = {};
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        return sendmsg(sock, &hdr, 0) == static_cast<ssize_t>(msg.size());
+    }
+
+    /** Body of the helper process: start the commands sent to it until
+        the server closes its end of the socket. */
+    static void serve(int sock) {
+        std::vector<char> buf(65536);
+        while (true) {
+            iovec iov = {&buf[0], buf.size()};
+            char control[CMSG_SPACE(sizeof(int))];
+            msghdr hdr = {};
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = sizeof(control);
+            const ssize_t len = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+            if ((len <= ssize_t(sizeof(ExecLimits))) || (cmsg == nullptr)) {
+                _exit(0);
+            }
+            int outFd;
+            memcpy(&outFd, CMSG_DATA(cmsg), sizeof(int));
+            ExecLimits limits;
+            memcpy(&limits, &buf[0], sizeof(limits));
+            std::vector<std::string> argList;
+            for (const char* arg = &buf[sizeof(limits)]; arg < &buf[len];
+                 arg += strlen(arg) + 1) {
+                argList.push_back(arg);
+            }
+            // Like fork, except that the child is a sibling of the
+            // helper: a child of the server.
+            const int pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0,
+                                    nullptr, nullptr, 0);
+            if (pid == 0) {
+                dup2(outFd, 1);     // Tie/redirect std::cout of command
+                setChildLimits(limits);
+                runChild(argList);
+            }
+            close(outFd);
+            send(sock, &pid, sizeof(pid), 0);
+        }
+    }
+
+    int sock;
+    int helper;
+    std::mutex mutex;  // Serializes requests to the helper
+};
+
+/**
+ * Create a spawner.
+ * 
+ * @param name The name of the spawner: fork, posix, or zygote.
+ * @return The spawner (posix for unknown names).
+ */
+std::unique_ptr<Spawner> makeSpawner(const std::string& name) {
+    if (name == "fork") {
+        return std::unique_ptr<Spawner>(new ForkSpawner());
+    } else if (name == "zygote") {
+        return std::unique_ptr<Spawner>(new ZygoteSpawner());
+    }
+    return std::unique_ptr<Spawner>(new PosixSpawner());
+}
+
+/**
+ * The spawner chosen with --spawner, created on first use.  The server
+ * creates it before starting threads, as a zygote must be forked while
+ * the server is still small.
+ */
+Spawner& spawner() {
+    static std::unique_ptr<Spawner> instance = makeSpawner(config.spawner);
+    return *instance;
+}
+
+/** Start the specified command with its std::cout tied to a pipe.
+
+    Both ends of the pipe are created close-on-exec so that children
+    spawned concurrently (for other clients) do not inherit each
+    other's pipes or the client sockets and hold them open.
+
+    \param[in] cmd The command to be executed
+
+    \param[in] args The command-line arguments, wich each one
     separated by one or more blank spaces.
 
-    \param[out] os The output stream to which outputs from child
-    process are to be sent.
+    \param[out] readFd The read-end of the pipe from which the output
+    of the child process is to be read.
+
+    \param[in] limits The CPU time and memory limits for the child.
+
+    \return The PID of the child process, or -1 if no process could be
+    started (nothing is then left to be reaped and readFd is -1).
 */
-void exec(std::string cmd, std::string args, std::ostream& os, bool genChart) {
+int spawnChild(const std::string& cmd, const std::string& args, int& readFd,
+               const ExecLimits& limits) {
     // Split string into individual command-line arguments.
     std::vector<std::string> cmdArgs = split(args);
     // Add command as the first of cmdArgs as per convention.
     cmdArgs.insert(cmdArgs.begin(), cmd);
     // Setup pipes to obtain inputs from child process
     int pipefd[2];
-    pipe(pipefd);
-    // String for html output
-    string html2Str = "";
-    // Finally fork and exec with parent having more work to do.
-    const int pid = fork();
-    if (pid == 0) {
-        close(pipefd[READ]);        // Close unused end.
-        dup2(pipefd[WRITE], 1);     // Tie/redirect std::cout of command
-        runChild(cmdArgs);
-    } else {
-        // Get second HTML portion + statistics
-        thread t(html2, pid, ref(html2Str), genChart);
-        // In parent process. First close unused end of the pipe and
-        // read standard inputs.
+    readFd = -1;
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    // Start the command with parent having more work to do.  If it
+    // could not be started (e.g., it was not found) fork it anyway so
+    // that the child reports the error as usual.
+    const auto start = std::chrono::steady_clock::now();
+    int pid = spawner().spawn(cmdArgs, pipefd[WRITE], limits);
+    if (pid == -1) {
+        pid = ForkSpawner().spawn(cmdArgs, pipefd[WRITE], limits);
+    }
+    metrics.spawn.observeSince(start);
+    if (pid == -1) {
+        close(pipefd[READ]);
         close(pipefd[WRITE]);
-        __gnu_cxx::stdio_filebuf<char> fb(pipefd[READ], std::ios::in, 1);
-        std::istream is(&fb);
-        // Have helper method process the output of child-process
-        sendData("text/html", pid, is, os, html2Str, t);
+        return -1;
+    }
+    metrics.activeChildren++;
+    // In parent process. First close unused end of the pipe.
+    close(pipefd[WRITE]);
+    readFd = pipefd[READ];
+    return pid;
+}
+
+/**
+ * Admission control for cgi-bin/exec requests.  Limits the number of
+ * commands running at once, in total (--max-children) and per command
+ * (--max-per-command, or --command-limit=cmd:N for specific ones).
+ * Requests beyond these limits wait for a free slot in a FIFO queue of
+ * at most --max-queue requests; further requests are rejected.
+ */
+class ExecLimiter {
+public:
+    using Start = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * Admit a request to run a command.
+     * 
+     * @param cmd The command to be run.
+     * @param start Called once the command may be started: right away
+     * (from this thread) if there is a free slot, otherwise from the
+     * thread that releases a slot for it.
+     * @return false if the request was rejected because the queue is
+     * full, in which case start is never called.
+     */
+    bool admit(const std::string& cmd, Start start) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!hasSlot(cmd)) {
+                if (queue.size() >= config.maxQueue) {
+                    rejected++;
+                    return false;
+                }
+                queue.push_back({cmd, std::move(start), Clock::now()});
+                return true;
+            }
+            take(cmd);
+        }
+        start();
+        return true;
+    }
+
+    /**
+     * Release the slot of a command that has finished, starting the
+     * queued requests that now fit in the limits.
+     * 
+     * @param cmd The command that has finished.
+     */
+    void release(const std::string& cmd) {
+        std::vector<Start> ready;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            running--;
+            if (--perCommand[cmd] == 0) {
+                perCommand.erase(cmd);
+            }
+            const Clock::time_point now = Clock::now();
+            for (auto req = queue.begin(); req != queue.end();) {
+                if (!hasSlot(req->cmd)) {
+                    req++;
+                    continue;
+                }
+                take(req->cmd);
+                const long waited = std::chrono::duration_cast<
+                    std::chrono::milliseconds>(now - req->queued).count();
+                waits++;
+                totalWait += waited;
+                maxWait = std::max(maxWait, waited);
+                ready.push_back(std::move(req->start));
+                req = queue.erase(req);
+            }
+        }
+        for (Start& start : ready) {
+            start();
+        }
+    }
+
+    /** A line reporting the commands running & queued and waits. */
+    std::string report() {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::ostringstream os;
+        os << "Commands: " << running << " running, " << queue.size()
+           << " queued, " << rejected << " rejected; " << waits
+           << " waited (avg " << (waits == 0 ? 0 : totalWait / waits)
+           << " ms, max " << maxWait << " ms)";
+        return os.str();
+    }
+
+private:
+    struct Request {
+        std::string cmd;
+        Start start;
+        Clock::time_point queued;
+    };
+
+    /** Determine if the limits allow 1 more instance of a command. */
+    bool hasSlot(const std::string& cmd) const {
+        if ((config.maxChildren != 0) && (running >= config.maxChildren)) {
+            return false;
+        }
+        const auto limit = config.commandLimits.find(cmd);
+        const size_t max = (limit != config.commandLimits.end() ?
+                            limit->second : config.maxPerCommand);
+        const auto count = perCommand.find(cmd);
+        return (max == 0) || (count == perCommand.end()) ||
+            (count->second < max);
+    }
+
+    /** Account for 1 more instance of a command running. */
+    void take(const std::string& cmd) {
+        running++;
+        perCommand[cmd]++;
+    }
+
+    std::mutex mutex;
+    std::list<Request> queue;
+    size_t running = 0;
+    std::unordered_map<std::string, size_t> perCommand;
+    long rejected = 0, waits = 0, totalWait = 0, maxWait = 0;
+};
+
+ExecLimiter limiter;
+
+/**
+ * A cache of the results of read-only commands (such as uptime) listed
+ * with --cache=cmd:ttl, keyed by the command, its arguments, and its
+ * limits.  Concurrent requests for a command that is not cached are
+ * coalesced: the first one runs the command and the others wait for
+ * its result.  Results expire after the TTL of the command and the
+ * soonest expiring ones are evicted to keep the total size of cached
+ * output within config.outputCacheSize.
+ */
+class CommandCache {
+public:
+    /** Called with the result of a command being run for another
+        request, or nullptr if it will not be cached. */
+    using Waiter = std::function<void(CachedResultPtr)>;
+
+    /** What the caller of lookup should do next. */
+    enum Lookup { Hit, Joined, Miss };
+
+    /**
+     * Obtain the TTL of a command.
+     * 
+     * @param cmd The command.
+     * @return The TTL in seconds or 0 if its results are not cached.
+     */
+    int ttl(const std::string& cmd) const {
+        const auto entry = config.cacheTtl.find(cmd);
+        return (entry == config.cacheTtl.end() ? 0 : entry->second);
+    }
+
+    /**
+     * Obtain the key for a command in the cache.
+     * 
+     * @param cmd The command.
+     * @param args Its arguments.
+     * @param limits Its limits.
+     * @return The key.
+     */
+    static std::string key(const std::string& cmd, const std::string& args,
+                           const ExecLimits& limits) {
+        return cmd + '\0' + args + '\0' + std::to_string(limits.timeout) +
+            ' ' + std::to_string(limits.cpuTime) + ' ' +
+            std::to_string(limits.memory);
+    }
+
+    /**
+     * Look up the result of a command.
+     * 
+     * @param key The key of the command.
+     * @param result Set to the result on a Hit.
+     * @param waiter Called (on another thread) with the result if the
+     * command is already being run for another request (Joined).
+     * @return Hit, Joined, or Miss if the caller must run the command
+     * and then call store() or abandon().
+     */
+    Lookup lookup(const std::string& key, CachedResultPtr& result,
+                  Waiter waiter) {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        Entry& entry = entries[key];
+        if (entry.result &&
+            (entry.result->expires > std::chrono::steady_clock::now())) {
+            metrics.cacheHits++;
+            result = entry.result;
+            return Hit;
+        } else if (entry.running) {
+            metrics.cacheJoins++;
+            entry.waiters.push_back(std::move(waiter));
+            return Joined;
+        }
+        metrics.cacheMisses++;
+        entry.running = true;
+        return Miss;
+    }
+
+    /**
+     * Add the result of a command run after a Miss and pass it to the
+     * requests that joined.
+     * 
+     * @param key The key of the command.
+     * @param ttl The TTL of the result in seconds.
+     * @param output The output of the command.
+     * @param result The exit code, usage, and samples of the command.
+     */
+    void store(const std::string& key, int ttl, std::string output,
+               const ChildResult& result) {
+        auto res = std::make_shared<CachedResult>();
+        res->output  = std::move(output);
+        res->result  = result;
+        res->expires = std::chrono::steady_clock::now() +
+            std::chrono::seconds(ttl);
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            Entry& entry = entries[key];
+            waiters.swap(entry.waiters);
+            entry.running = false;
+            used += res->output.size() - (entry.result ?
+                                          entry.result->output.size() : 0);
+            entry.result = res;
+            evict();
+        }
+        for (Waiter& waiter : waiters) {
+            waiter(res);
+        }
+    }
+
+    /**
+     * Give up on caching a command after a Miss (e.g., it was rejected
+     * or had too much output).  Requests that joined get nullptr.
+     * 
+     * @param key The key of the command.
+     */
+    void abandon(const std::string& key) {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            Entry& entry = entries[key];
+            waiters.swap(entry.waiters);
+            entry.running = false;
+        }
+        for (Waiter& waiter : waiters) {
+            waiter(nullptr);
+        }
+    }
+
+private:
+    struct Entry {
+        CachedResultPtr result;
+        bool running = false;
+        std::vector<Waiter> waiters;
+    };
+
+    /** Remove expired results, then the soonest expiring ones until the
+        output fits in the cache.  Called with cacheMutex locked. */
+    void evict() {
+        const auto now = std::chrono::steady_clock::now();
+        for (auto entry = entries.begin(); (entry != entries.end()); ) {
+            const CachedResultPtr& res = entry->second.result;
+            if (!entry->second.running && (!res || res->expires <= now)) {
+                used -= (res ? res->output.size() : 0);
+                entry = entries.erase(entry);
+            } else {
+                entry++;
+            }
+        }
+        while (used > config.outputCacheSize) {
+            auto oldest = entries.end();
+            for (auto entry = entries.begin(); (entry != entries.end());
+                 entry++) {
+                if (entry->second.result && ((oldest == entries.end()) ||
+                    (entry->second.result->expires <
+                     oldest->second.result->expires))) {
+                    oldest = entry;
+                }
+            }
+            used -= oldest->second.result->output.size();
+            oldest->second.result.reset();
+        }
+    }
+
+    size_t used = 0;
+    std::unordered_map<std::string, Entry> entries;
+    std::mutex cacheMutex;
+};
+
+CommandCache commandCache;
+
+/**
+ * Send a cached result of a command as the page exec would have sent,
+ * but all at once: the statistics, then the output, then the exit code.
+ *
+ * @param os The output stream to send data to client.
+ * @param res The cached result.
+ * @param genChart If this flag is true then generate data for chart.
+ * @param encoding The content-encoding for the response or "".
+ * @param keepAlive If true the connection is kept open.
+ */
+void sendCached(std::ostream& os, const CachedResult& res, bool genChart,
+                const std::string& encoding, bool keepAlive = false) {
+    std::string page = html1(genChart);
+    for (const StatSample& sample : res.result.samples) {
+        page += sampleScript(sample, false);
+    }
+    appendEscaped(page, res.output.data(), res.output.size());
+    page += html2(res.result);
+    os << "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n";
+    if (!encoding.empty()) {
+        os << "Content-Encoding: " << encoding << "\r\n"
+           << "Vary: Accept-Encoding\r\n";
+        page = Compressor(encoding).compress(page, true);
+    }
+    os << "Transfer-Encoding: chunked\r\nConnection: "
+       << (keepAlive ? "keep-alive" : "Close") << "\r\n\r\n"
+       << chunk(page) << "0\r\n\r\n";
+}
+
+/**
+ * Send a cached result of a command as sendData would have sent it,
+ * in the original layout of the offline page.
+ *
+ * @param os The output stream to send data to client.
+ * @param res The cached result.
+ * @param genChart If this flag is true then generate data for chart.
+ */
+void sendClassic(std::ostream& os, const CachedResult& res, bool genChart) {
+    os << "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n"
+       << "Transfer-Encoding: chunked\r\nConnection: Close\r\n\r\n"
+       << chunk(classicHtml1())
+       << (res.output.empty() ? "" : chunk(res.output))
+       << classicHtml2(res.result, genChart) << "0\r\n\r\n";
+}
+
+/** Run the specified command and send output back to the user.
+
+    This method runs the specified command and sends the data back to
+    the client using chunked-style response.
+
+    \param[in] cmd The command to be executed
+
+    \param[in] args The command-line arguments, wich each one
+    separated by one or more blank spaces.
+
+    \param[out] os The output stream to which outputs from child
+    process are to be sent.
+
+    \param[in] limits The limits of the child process.
+
+    \param[out] capture If not nullptr, the output and result of the
+    command are also kept here for the CommandCache.
+
+    \return false if the command could not be started (and a 500 was
+    sent instead).
+*/
+bool exec(std::string cmd, std::string args, std::ostream& os, bool genChart,
+          const ExecLimits& limits, CachedResult* capture = nullptr) {
+    int readFd;
+    const int pid = spawnChild(cmd, args, readFd, limits);
+    if (pid == -1) {
+        send500(os, cmd);
+        return false;
+    }
+    // Have helper method process the output of child-process
+    const ChildResult res = sendData("text/html", pid, readFd, os, genChart,
+                                     limits, capture);
+    history.record(cmd, args, res);
+    return true;
+}
+
+/** Run the specified command and send its raw output to the user.
+
+    This method is used for "&raw=1" requests.  The output of the
+    command is sent as text/plain, without the HTML page, statistics,
+    or exit code.
+
+    \param[in] cmd The command to be executed
+
+    \param[in] args The command-line arguments.
+
+    \param[out] os The output stream to which outputs from child
+    process are to be sent.
+
+    \param[in] limits The limits of the child process.
+*/
+void execRaw(const std::string& cmd, const std::string& args,
+             std::ostream& os, const ExecLimits& limits) {
+    int readFd;
+    const int pid = spawnChild(cmd, args, readFd, limits);
+    if (pid == -1) {
+        send500(os, cmd);
+        return;
+    }
+    os << "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+       << "Transfer-Encoding: chunked\r\nConnection: Close\r\n\r\n";
+    // Nothing is reported about the child, but it is kept in history.
+    sampler.track(pid, [cmd, args](ChildResult& res) {
+        history.record(cmd, args, res);
+    }, nullptr, limits);
+    ChunkWriter(readFd, os).relay();
+    close(readFd);
+    sampler.outputClosed(pid);
+    os << "0\r\n\r\n";
+}
+
+/**
+ * Obtain the value of a parameter from the query string of a request.
+ * 
+ * @param req The parsed request, e.g., for "a?x=1&y=2".
+ * @param name The name of the parameter.
+ * @return The URL-decoded value of the parameter or "" if not present.
+ */
+std::string getQueryParam(const RequestParser& req, std::string_view name) {
+    return url_decode(std::string(req.queryParam(name)));
+}
+
+/**
+ * Convenience method to extract the command and its arguments from a
+ * path of the form "cgi-bin/exec?cmd=<cmd>&args=<args>".
+ *
+ * @param req The parsed request.
+ * @param cmd The command to be executed (if path is a cgi-bin request).
+ * @param args The URL-decoded arguments for the command.
+ * @return true if the path is a cgi-bin request.
+ */
+bool getCgiCommand(const RequestParser& req, std::string& cmd,
+                   std::string& args) {
+    if ((req.path != "cgi-bin/exec") ||
+        (req.target.size() == req.path.size() + 1)) {
+        return false;  // Not a cgi-bin request or no query string
+    }
+    // Extract the command and parameters for exec.
+    cmd  = getQueryParam(req, "cmd");
+    args = getQueryParam(req, "args");
+    return true;
+}
+
+/**
+ * Obtain the limits for a command from the optional timeout, cpu (both
+ * in seconds) and mem (in MB) query parameters of a cgi-bin request.
+ * These can only lower the limits set for the server with --timeout,
+ * --cpu-limit, and --mem-limit.
+ *
+ * @param req The parsed request.
+ * @return The limits for the command.
+ */
+ExecLimits getExecLimits(const RequestParser& req) {
+    // The lower of the requested & server limits, where 0 is no limit.
+    auto lower = [&req](std::string_view name, long server) {
+        const std::string value = getQueryParam(req, name);
+        const long req = (value.empty() ? 0 : std::atol(value.c_str()));
+        return (req <= 0 ? server : (server == 0 ? req :
+                                     std::min(req, server)));
+    };
+    ExecLimits limits;
+    limits.timeout = lower("timeout", config.limits.timeout);
+    limits.cpuTime = lower("cpu", config.limits.cpuTime);
+    limits.memory  = lower("mem", config.limits.memory);
+    return limits;
+}
+
+/**
+ * Obtain the response to a cgi-bin/history?cmd=<cmd>&n=<count> request:
+ * the last runs of the command (20 unless n is given) from the history,
+ * as JSON.
+ *
+ * @param req The parsed request.
+ * @param keepAlive If true the connection is kept open.
+ * @return The response, or "" if no history is kept.
+ */
+std::string historyResponse(const RequestParser& req, bool keepAlive) {
+    if (!history.isOpen()) {
+        return "";
+    }
+    const std::string count = getQueryParam(req, "n");
+    const std::string json = history.query(getQueryParam(req, "cmd"),
+        count.empty() ? 20 : std::max(0L, std::atol(count.c_str())));
+    return fileHeader("history.json", json.size(), keepAlive) + json;
+}
+
+/**
+ * Process HTTP request (from first line & headers) and
+ * provide suitable HTTP response back to the client.
+ * 
+ * @param is The input stream to read data from client.
+ * @param os The output stream to send data to client.
+ * @param genChart If this flag is true then generate data for chart.
+ */
+void serveClient(std::istream& is, std::ostream& os, bool genChart) {
+    // Read the request line & headers, a line at a time (so no data
+    // after them is consumed), into a buffer for the parser.
+    std::vector<char> head(config.maxHeaderSize);
+    RequestParser req;
+    RequestParser::Result result = RequestParser::Incomplete;
+    for (size_t len = 0; (result == RequestParser::Incomplete); ) {
+        is.getline(head.data() + len, head.size() - len);
+        len += is.gcount();
+        if (is.eof() || is.bad()) {
+            result = RequestParser::Invalid;  // Ended before a blank line
+        } else if (!is.fail()) {
+            head[len - 1] = '\n';  // getline replaced it with '\0'
+            result = req.parse(head.data(), len);
+        } else {
+            result = RequestParser::TooLarge;
+        }
+    }
+    if (result != RequestParser::Complete) {
+        send400(os, result);
+        return;
+    }
+    const std::string path = getFilePath(req);
+    const std::string encoding = getEncoding(req.header("accept-encoding"));
+    // Check and dispatch the request appropriately
+    std::string cmd, args;
+    if (path == "metrics") {
+        metrics.metricsRequests++;
+        const std::string text = metricsText();
+        os << fileHeader(path, text.size(), false) << text;
+    } else if (req.path == "cgi-bin/history") {
+        const std::string response = historyResponse(req, false);
+        if (response.empty()) {
+            metrics.notFoundRequests++;
+            send404(os, path);
+        } else {
+            metrics.cgiRequests++;
+            os << response;
+        }
+    } else if (getCgiCommand(req, cmd, args)) {
+        const ExecLimits limits = getExecLimits(req);
+        const bool raw = (req.queryParam("raw") == "1");
+        // Serve a cached result of the command, if it has one, or wait
+        // for the result if it is already being run for another request.
+        const int ttl = (raw ? 0 : commandCache.ttl(cmd));
+        const std::string key = CommandCache::key(cmd, args, limits);
+        CommandCache::Lookup lookup = CommandCache::Miss;
+        if (ttl > 0) {
+            CachedResultPtr cached;
+            std::promise<CachedResultPtr> joined;
+            lookup = commandCache.lookup(key, cached,
+                [&joined](CachedResultPtr res) { joined.set_value(res); });
+            if (lookup == CommandCache::Joined) {
+                cached = joined.get_future().get();
+            }
+            if (cached) {
+                metrics.cgiRequests++;
+                sendClassic(os, *cached, genChart);
+                return;
+            }
+        }
+        const bool caching = (ttl > 0) && (lookup == CommandCache::Miss);
+        // Wait for the command to be admitted (or reject it).
+        std::promise<void> admitted;
+        if (!limiter.admit(cmd, [&admitted] { admitted.set_value(); })) {
+            if (caching) {
+                commandCache.abandon(key);
+            }
+            metrics.rejectedRequests++;
+            send503(os, cmd);
+            return;
+        }
+        admitted.get_future().wait();
+        metrics.cgiRequests++;
+        // Now run the command and return result back to client.
+        if (raw) {
+            execRaw(cmd, args, os, limits);
+        } else if (!caching) {
+            exec(cmd, args, os, genChart, limits);
+        } else {
+            CachedResult res;
+            if (exec(cmd, args, os, genChart, limits, &res) &&
+                (res.output.size() <= config.maxCachedOutput)) {
+                commandCache.store(key, ttl, std::move(res.output),
+                                   res.result);
+            } else {
+                commandCache.abandon(key);
+            }
+        }
+        limiter.release(cmd);
+    } else {
+        // Send contents of the file (or a 404) to the client.
+        sendFile(os, path, encoding);
     }
 }
 
+//------------------------------------------------------------------
+//  Asynchronous connection engine used by runServer
+//------------------------------------------------------------------
+
 /**
- * Process HTTP request (from first line & headers) and
- * provide suitable HTTP response back to the client.
+ * Set the close-on-exec flag on a socket so that child processes
+ * spawned for cgi-bin requests do not hold client connections open.
  * 
- * @param is The input stream to read data from client.
- * @param os The output stream to send data to client.
- * @param genChart If this flag is true then generate data for chart.
+ * @param fd The file descriptor to be flagged.
  */
-void serveClient(std::istream& is, std::ostream& os, bool genChart) {
-    // Read headers from client and print them. This server
-    // does not really process client headers
+void setCloseOnExec(int fd) {
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+/**
+ * Obtain the number of threads in this process from /proc/self/status.
+ * 
+ * @return The number of threads, including helper threads.
+ */
+int processThreadCount() {
+    std::ifstream status("/proc/self/status");
     std::string line;
-    // Read the GET request line.
-    std::getline(is, line);
-    const std::string path = getFilePath(line);
-    // Skip/ignore all the HTTP request & headers for now.
-    while (std::getline(is, line) && (line != "\r")) {}
-    // Check and dispatch the request appropriately
-    const std::string cgiPrefix = "cgi-bin/exec?cmd=";
-    const int prefixLen         = cgiPrefix.size();
-    if (path.substr(0, prefixLen) == cgiPrefix) {
-        // Extract the command and parameters for exec.
-        const size_t argsPos   = path.find("&args=", prefixLen);
-        const std::string cmd  = path.substr(prefixLen, argsPos - prefixLen);
-        const std::string args = url_decode(path.substr(argsPos + 6));
-        // Now run the command and return result back to client.
-        exec(cmd, args, os, genChart);
-    } 
-    /* else {  it will never go here in either base case 
-        Get the file size (if path exists)
-        std::ifstream dataFile(path);
-        if (!dataFile.good()) {
-            Invalid file/File not found. Return 404 error message.
-            send404(os, path);
+    while (std::getline(status, line)) {
+        if (line.substr(0, 8) == "Threads:") {
+            return std::stoi(line.substr(8));
+        }
+    }
+    return -1;
+}
+
+/**
+ * Convenience method to wrap data into a chunk of a chunked response.
+ * 
+ * @param data The data to be sent as 1 chunk.
+ * @return The data with size (in hex) & trailing new line added.
+ */
+std::string chunk(const std::string& data) {
+    return chunkHeader(data.size()).append(data).append("\r\n");
+}
+
+/**
+ * Obtain the line with the size (in hex) that starts a chunk.
+ * 
+ * @param size The number of bytes in the chunk.
+ * @return The size line.
+ */
+std::string chunkHeader(size_t size) {
+    char line[24];
+    return std::string(line, snprintf(line, sizeof(line), "%zx\r\n", size));
+}
+
+/**
+ * The constant parts of responses, with their chunk sizes, made once at
+ * startup.  Responses are sent as a gather-write of these and the
+ * variable parts (such as the job link or exit code), so the constant
+ * parts are not formatted or copied again for each request.
+ */
+struct Fragments {
+    Fragments() {
+        for (const bool keepAlive : {false, true}) {
+            htmlHeader[keepAlive] = "HTTP/1.1 200 OK\r\nContent-Type: "
+                "text/html\r\nTransfer-Encoding: chunked\r\nConnection: " +
+                std::string(keepAlive ? "keep-alive" : "Close") + "\r\n\r\n";
+        }
+        for (const bool genChart : {false, true}) {
+            pageStart[genChart] = chunk(html1Start(genChart));
+        }
+        pageOutput = chunk(html1End());
+        std::ostringstream bad, large;
+        send400(bad, RequestParser::Invalid);
+        send400(large, RequestParser::TooLarge);
+        badRequest = bad.str();
+        tooLarge   = large.str();
+    }
+
+    /** 200 header of a chunked HTML page, indexed by keepAlive. */
+    std::string htmlHeader[2];
+    /** Chunks of html1 before and after the job link. */
+    std::string pageStart[2], pageOutput;
+    /** The last (empty) chunk of a response. */
+    std::string lastChunk = "0\r\n\r\n";
+    /** Whole responses to invalid and too large requests. */
+    std::string badRequest, tooLarge;
+};
+
+const Fragments fragments;
+
+/**
+ * A client connection processed using asynchronous operations on a
+ * fixed pool of threads running the io_service.  All handlers of a
+ * connection run on its strand, so they never run concurrently.
+ *
+ * Memory used by a connection is bounded: the request is read into a
+ * buffer of config.maxHeaderSize bytes (parsed in place by a
+ * RequestParser) and output from a child
+ * process is coalesced into chunks of at most config.chunkSize bytes
+ * (like ChunkWriter does) -- the pipe is not read while a full chunk is
+ * waiting for the previous one to be written.
+ *
+ * Connections are persistent (HTTP/1.1 keep-alive).  Requests are
+ * processed one at a time, so pipelined requests that arrive while a
+ * response is being sent simply wait in the buffer (or socket) and are
+ * answered in order.  Idle connections are closed after
+ * config.keepAliveTimeout seconds and every connection is closed after
+ * config.maxRequests requests.
+ */
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    explicit Connection(io_service& service) : strand(service),
+        sock(service), pipe(service), idleTimer(service), flushTimer(service),
+        reqBuf(config.maxHeaderSize) {
+        activeConnections++;
+        totalConnections++;
+    }
+
+    ~Connection() {
+        activeConnections--;
+        if (!cacheKey.empty()) {
+            commandCache.abandon(cacheKey);  // Client went away
+        }
+    }
+
+    tcp::socket& socket() { return sock; }
+
+    /** Start processing the connection by reading the next request. */
+    void start() {
+        // Move any pipelined data after the previous request to the
+        // front of the buffer.
+        if (parser.size() > 0) {
+            reqLen -= parser.size();
+            memmove(reqBuf.data(), reqBuf.data() + parser.size(), reqLen);
+            parser.reset();
+        }
+        // Reset the state of the previous response.
+        outputDone = statsDone = reading = writing = false;
+        // Close the connection if the client stays idle for too long.
+        waiting = true;
+        idleTimer.expires_after(std::chrono::seconds(config.keepAliveTimeout));
+        idleTimer.async_wait(strand.wrap(
+            [self = shared_from_this()](const boost::system::error_code& ec) {
+                if (!ec && self->waiting) {
+                    self->close();
+                }
+            }));
+        readRequest();
+    }
+
+private:
+    /** Parse the data received so far and read more of the request
+        until its request line and headers are complete. */
+    void readRequest() {
+        const auto parseStart = std::chrono::steady_clock::now();
+        const RequestParser::Result result = parser.parse(reqBuf.data(),
+                                                          reqLen);
+        if (result == RequestParser::Incomplete) {
+            sock.async_read_some(buffer(reqBuf.data() + reqLen,
+                                        reqBuf.size() - reqLen), strand.wrap(
+                [self = shared_from_this()](
+                    const boost::system::error_code& ec, size_t len) {
+                    self->reqLen += len;
+                    if (!ec) {
+                        self->readRequest();
+                    }
+                }));
+            return;
+        }
+        waiting = false;
+        idleTimer.cancel();
+        requestStart = parseStart;
+        firstByteSent = false;
+        if (result == RequestParser::Complete) {
+            processRequest();
+        } else {
+            // Reply to a malformed or too large request and close.
+            keepAlive = false;
+            write(std::array<const_buffer, 1>{buffer(
+                result == RequestParser::TooLarge ? fragments.tooLarge :
+                fragments.badRequest)}, &Connection::responseDone);
+        }
+    }
+
+    /** Dispatch the request once the request line and headers are
+        parsed. */
+    void processRequest() {
+        keepAlive = (++requests < config.maxRequests) && parser.keepAlive();
+        encoding = getEncoding(parser.header("accept-encoding"));
+        const std::string path = getFilePath(parser);
+        std::string cmd, args;
+        struct stat info;
+        const bool cgi = getCgiCommand(parser, cmd, args);
+        metrics.headerParse.observeSince(requestStart);
+        if (path == "metrics") {
+            metrics.metricsRequests++;
+            const std::string text = metricsText();
+            write(fileHeader(path, text.size(), keepAlive) + text,
+                  &Connection::responseDone);
+        } else if (parser.path == "cgi-bin/stream") {
+            streamJob(path);
+        } else if (parser.path == "cgi-bin/history") {
+            sendHistory(path);
+        } else if (cgi) {
+            const bool raw = (parser.queryParam("raw") == "1");
+            const ExecLimits limits = getExecLimits(parser);
+            const int ttl = (raw ? 0 : commandCache.ttl(cmd));
+            if (ttl > 0) {
+                lookupCommand(cmd, args, limits, ttl);
+            } else {
+                runCommand(cmd, args, raw, limits, "");
+            }
+        } else if (!getStaticFile(path, info)) {
+            sendNotFound(path);
+        } else {
+            sendStaticFile(path, info);
+        }
+    }
+
+    /** Serve a cached result of a command, wait for its result if it is
+        already being run for another request, or run it and cache its
+        result. */
+    void lookupCommand(const std::string& cmd, const std::string& args,
+                       const ExecLimits& limits, int ttl) {
+        const std::string key = CommandCache::key(cmd, args, limits);
+        CachedResultPtr cached;
+        auto self = shared_from_this();
+        switch (commandCache.lookup(key, cached,
+            [self, cmd, args, limits](CachedResultPtr res) {
+                self->strand.dispatch([self, cmd, args, limits, res] {
+                    if (res) {
+                        self->sendCachedResult(*res);
+                    } else {
+                        self->runCommand(cmd, args, false, limits, "");
+                    }
+                });
+            })) {
+        case CommandCache::Hit:
+            sendCachedResult(*cached);
+            break;
+        case CommandCache::Joined:
+            break;  // The callback sends the result
+        case CommandCache::Miss:
+            cacheTtl = ttl;
+            runCommand(cmd, args, false, limits, key);
+            break;
+        }
+    }
+
+    /** Send a result of a command from the CommandCache. */
+    void sendCachedResult(const CachedResult& res) {
+        metrics.cgiRequests++;
+        std::ostringstream os;
+        sendCached(os, res, true, encoding, keepAlive);
+        write(os.str(), &Connection::responseDone);
+    }
+
+    /** Run the command once admitted, on this strand.  The output and
+        result are cached if a key is given (after a cache miss). */
+    void runCommand(const std::string& cmd, const std::string& args,
+                    bool raw, const ExecLimits& limits,
+                    const std::string& key) {
+        auto self = shared_from_this();
+        if (!limiter.admit(cmd, [self, cmd, args, raw, limits, key] {
+                self->strand.dispatch([self, cmd, args, raw, limits, key] {
+                    metrics.cgiRequests++;
+                    self->cacheKey = key;
+                    self->captured.clear();
+                    if (raw) {
+                        self->execRawCommand(cmd, args, limits);
+                    } else {
+                        self->execCommand(cmd, args, limits);
+                    }
+                });
+            })) {
+            if (!key.empty()) {
+                commandCache.abandon(key);
+            }
+            metrics.rejectedRequests++;
+            std::ostringstream os;
+            send503(os, cmd, keepAlive);
+            write(os.str(), &Connection::responseDone);
+        }
+    }
+
+    /** Stream the statistics of a job as Server-Sent Events until it
+        finishes.  Events are queued by the job's callback and written
+        to the socket one batch at a time. */
+    void streamJob(const std::string& path) {
+        const std::string id(parser.queryParam("id"));
+        const JobPtr job = jobs.find(std::atol(id.c_str()));
+        if (!job) {
+            sendNotFound(path);
+            return;
+        }
+        metrics.cgiRequests++;
+        pending.clear();
+        eventsDone = false;
+        writing = true;
+        write("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+              "Cache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n"
+              "Connection: " + std::string(keepAlive ? "keep-alive" :
+                                            "Close") + "\r\n\r\n",
+              &Connection::eventsWritten);
+        job->subscribe([self = shared_from_this()](const std::string& events,
+                                                   bool last) {
+            self->strand.post([self, events, last] {
+                self->pending += events;
+                self->eventsDone = last;
+                self->writeEvents();
+            });
+        });
+    }
+
+    /** Write the events queued so far, ending the response after the
+        last one. */
+    void writeEvents() {
+        if (writing || pending.empty()) {
+            return;  // Called again once the current write is done.
+        }
+        writing = true;
+        std::string data = chunk(pending);
+        pending.clear();
+        if (eventsDone) {
+            write(data + "0\r\n\r\n", &Connection::responseDone);
+        } else {
+            write(data, &Connection::eventsWritten);
+        }
+    }
+
+    void eventsWritten() {
+        writing = false;
+        writeEvents();
+    }
+
+    /** Send the last runs of a command from the history (or a 404 if
+        no history is kept). */
+    void sendHistory(const std::string& path) {
+        std::string response = historyResponse(parser, keepAlive);
+        if (response.empty()) {
+            sendNotFound(path);
+            return;
+        }
+        metrics.cgiRequests++;
+        write(std::move(response), &Connection::responseDone);
+    }
+
+    /** Send a 404 for a path that cannot be served. */
+    void sendNotFound(const std::string& path) {
+        metrics.notFoundRequests++;
+        std::ostringstream os;
+        send404(os, path, keepAlive);
+        write(os.str(), &Connection::responseDone);
+    }
+
+    /** Send a static file.  Small files are sent from the file cache
+        with a single gather-write of the header (made once with the
+        cache entry) and mapped (or gzipped) file contents.  Larger files are sent with sendfile directly
+        from the disk, uncompressed. */
+    void sendStaticFile(const std::string& path, const struct stat& info) {
+        const size_t size = info.st_size;
+        if (size <= config.maxCachedFile) {
+            fileBody = fileCache.get(path, info);
+        } else {
+            fileFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        if (!fileBody && (fileFd == -1)) {
+            sendNotFound(path);
+            return;
+        }
+        metrics.staticRequests++;
+        if (fileBody && gzipFile(path, size, encoding)) {
+            const std::string& body = fileBody->gzipped();
+            write(std::array<const_buffer, 2>{
+                    buffer(fileBody->gzipHeader(keepAlive)), buffer(body)},
+                &Connection::fileBodyWritten);
+        } else if (fileBody) {
+            write(std::array<const_buffer, 2>{
+                    buffer(fileBody->header(keepAlive)),
+                    buffer(fileBody->data, fileBody->size)},
+                &Connection::fileBodyWritten);
+        } else {
+            outBuf = fileHeader(path, size, keepAlive);
+            fileOffset = 0;
+            fileRemaining = size;
+            write(outBuf, &Connection::sendFileData);
+        }
+    }
+
+    /** Release the cached file (kept mapped until it was sent). */
+    void fileBodyWritten() {
+        fileBody.reset();
+        responseDone();
+    }
+
+    /** Send as much of the file as the socket accepts with sendfile and
+        wait for the socket to be writable again to send the rest. */
+    void sendFileData() {
+        sock.native_non_blocking(true);
+        while (fileRemaining > 0) {
+            const ssize_t sent = sendfile(sock.native_handle(), fileFd,
+                                          &fileOffset, fileRemaining);
+            if (sent > 0) {
+                fileRemaining -= sent;
+                metrics.bytesSent += sent;
+            } else if ((sent == -1) && (errno == EAGAIN)) {
+                sock.async_wait(tcp::socket::wait_write, strand.wrap(
+                    [self = shared_from_this()](
+                        const boost::system::error_code& ec) {
+                        if (!ec) {
+                            self->sendFileData();
+                        } else {
+                            self->closeFile();
+                        }
+                    }));
+                return;
+            } else {
+                break;  // Client went away or file shrank
+            }
+        }
+        const bool done = (fileRemaining == 0);
+        closeFile();
+        if (done) {
+            responseDone();
+        }
+    }
+
+    void closeFile() {
+        ::close(fileFd);
+        fileFd = -1;
+    }
+
+    /** Run the command and start relaying its output to the client. */
+    void execCommand(const std::string& cmd, const std::string& args,
+                     const ExecLimits& limits) {
+        int readFd;
+        pid = spawnChild(cmd, args, readFd, limits);
+        if (pid == -1) {
+            spawnFailed(cmd);
+            return;
+        }
+        pipe.assign(readFd);
+        outputDone = statsDone = reading = writing = false;
+        pipeBuf.resize(config.chunkSize);
+        gzip.reset(encoding.empty() ? nullptr : new Compressor(encoding));
+        // Have the sampler pass samples to the strand (and to viewers of
+        // the job) as they are added to the series and let it know once
+        // the child finished.
+        auto self = shared_from_this();
+        JobPtr job = jobs.start();
+        sampler.track(pid, [self, cmd, args, job](ChildResult& result) {
+            limiter.release(cmd);
+            history.record(cmd, args, result);
+            job->finish(result);
+            jobs.finished(job->id);
+            self->strand.post([self, result = std::move(result)] {
+                self->result = result;
+                self->statsDone = true;
+                self->finishExec();
+            });
+        }, [self, job](const StatSample& sample, bool halved) {
+            job->publish(sample, halved);
+            self->strand.post([self, script = sampleScript(sample, halved)] {
+                self->appendPending(script);
+                self->flushOutput();
+            });
+        }, limits);
+        // First write the fixed HTTP header and the start of the page,
+        // from the fragments unless it is compressed.
+        writing = true;
+        if (gzip) {
+            write("HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n"
+                  "Content-Encoding: " + encoding + "\r\nVary: "
+                  "Accept-Encoding\r\nTransfer-Encoding: chunked\r\n"
+                  "Connection: " + (keepAlive ? "keep-alive" : "Close") +
+                  "\r\n\r\n" + encodedChunk(html1(true, job->id)),
+                  &Connection::outputWritten);
+        } else {
+            outBuf = chunk(jobLink(job->id));
+            write(std::array<const_buffer, 4>{
+                    buffer(fragments.htmlHeader[keepAlive]),
+                    buffer(fragments.pageStart[true]), buffer(outBuf),
+                    buffer(fragments.pageOutput)},
+                &Connection::outputWritten);
+        }
+    }
+
+    /** Reply with a 500 when a command could not be started, releasing
+        its slot and its entry in the CommandCache (if it has one). */
+    void spawnFailed(const std::string& cmd) {
+        limiter.release(cmd);
+        if (!cacheKey.empty()) {
+            commandCache.abandon(cacheKey);
+            cacheKey.clear();
+        }
+        std::ostringstream os;
+        send500(os, cmd, keepAlive);
+        write(os.str(), &Connection::responseDone);
+    }
+
+    /** Make a chunk of the page, compressed if the client accepts it.
+        The last chunk ends the compressed data. */
+    std::string encodedChunk(const std::string& data, bool last = false) {
+        return chunk(gzip ? gzip->compress(data, last) : data);
+    }
+
+    /** Read the next block of output from the child process, as long
+        as there is room for it in the chunk being coalesced. */
+    void relayOutput() {
+        if (reading || outputDone || (pending.size() >= config.chunkSize)) {
+            return;
+        }
+        reading = true;
+        const size_t room = std::min(pipeBuf.size(),
+                                     config.chunkSize - pending.size());
+        pipe.async_read_some(buffer(&pipeBuf[0], room), strand.wrap(
+            [self = shared_from_this()](const boost::system::error_code& ec,
+                                        size_t len) {
+                self->outputRead(ec, len);
+            }));
+    }
+
+    /** Add (escaped) output from the child to the pending chunk, sending
+        it when it is full. */
+    void outputRead(const boost::system::error_code& ec, size_t len) {
+        reading = false;
+        if (ec) {
+            pipe.close();
+            sampler.outputClosed(pid);
+            outputDone = true;
+            flushOutput();
+            return;
+        }
+        if (!cacheKey.empty() && (captured.size() <= config.maxCachedOutput)) {
+            captured.append(&pipeBuf[0], std::min(len, config.maxCachedOutput +
+                                                  1 - captured.size()));
+        }
+        std::string text;
+        appendEscaped(text, &pipeBuf[0], len);
+        appendPending(text);
+        if (pending.size() >= config.chunkSize) {
+            flushOutput();
+        }
+        relayOutput();
+    }
+
+    /** Add data to the pending chunk, starting the flush deadline if it
+        is a new chunk. */
+    void appendPending(const std::string& data) {
+        if (pending.empty()) {
+            flushTimer.expires_after(
+                std::chrono::milliseconds(config.flushDelay));
+            flushTimer.async_wait(strand.wrap(
+                [self = shared_from_this()](
+                    const boost::system::error_code& ec) {
+                    if (!ec) {
+                        self->flushOutput();
+                    }
+                }));
+        }
+        pending += data;
+    }
+
+    /** Send the pending output as 1 chunk (once the previous write has
+        finished) and move on to the exit code after the last chunk. */
+    void flushOutput() {
+        if (writing || failed) {
+            return;  // Called again once the current write is done.
+        }
+        if (pending.empty()) {
+            finishExec();
+            return;
+        }
+        flushTimer.cancel();
+        writing = true;
+        write(encodedChunk(pending), &Connection::outputWritten);
+        pending.clear();
+    }
+
+    /** Continue relaying once a chunk has been written to the client. */
+    void outputWritten() {
+        writing = false;
+        if (outputDone || (pending.size() >= config.chunkSize)) {
+            flushOutput();
+        }
+        relayOutput();
+    }
+
+    /** Send exit code & end of the page once the pipe is drained and
+        the child has exited, in whichever order they finish. */
+    void finishExec() {
+        if (!outputDone || !statsDone || writing || !pending.empty() ||
+            failed) {
+            return;  // The destructor abandons the cache key if failed
+        }
+        if (captured.size() > config.maxCachedOutput) {
+            commandCache.abandon(cacheKey);  // Too much output to cache
+        } else if (!cacheKey.empty()) {
+            commandCache.store(cacheKey, cacheTtl, std::move(captured),
+                               result);
+        }
+        cacheKey.clear();
+        captured.clear();
+        // No more chunks may be written (e.g., by a stale flushTimer)
+        // until the next response.
+        flushTimer.cancel();
+        writing = true;
+        outBuf = encodedChunk(html2(result), true);
+        write(std::array<const_buffer, 2>{buffer(outBuf),
+                buffer(fragments.lastChunk)}, &Connection::responseDone);
+    }
+
+    /** Run the command for a "&raw=1" request.  Its output is moved
+        from the pipe to the socket with splice, without being copied
+        into user space, and framed as chunks of the size available in
+        the pipe at the time. */
+    void execRawCommand(const std::string& cmd, const std::string& args,
+                        const ExecLimits& limits) {
+        int readFd;
+        pid = spawnChild(cmd, args, readFd, limits);
+        if (pid == -1) {
+            spawnFailed(cmd);
+            return;
+        }
+        // Nothing is reported about the child, but it is kept in history.
+        sampler.track(pid, [cmd, args](ChildResult& result) {
+            limiter.release(cmd);
+            history.record(cmd, args, result);
+        }, nullptr, limits);
+        pipe.assign(readFd);
+        spliceChunks = 0;
+        write("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+              "Transfer-Encoding: chunked\r\nConnection: " +
+              std::string(keepAlive ? "keep-alive" : "Close") + "\r\n\r\n",
+              &Connection::waitRawOutput);
+    }
+
+    /** Wait for output from the child to become available. */
+    void waitRawOutput() {
+        pipe.async_wait(posix::stream_descriptor::wait_read, strand.wrap(
+            [self = shared_from_this()](const boost::system::error_code& ec) {
+                if (!ec) {
+                    self->startSpliceChunk();
+                }
+            }));
+    }
+
+    /** Send the chunk header for the data available in the pipe (with
+        the end of the previous chunk) or the trailer at end of output. */
+    void startSpliceChunk() {
+        int avail = 0;
+        ioctl(pipe.native_handle(), FIONREAD, &avail);
+        if (avail == 0) {
+            // Either the child closed its end or the wait completed
+            // speculatively, without the pipe actually being readable.
+            pollfd pfd = {pipe.native_handle(), POLLIN, 0};
+            if (poll(&pfd, 1, 0) == 0) {
+                waitRawOutput();
+                return;
+            }
+        }
+        // End of previous chunk
+        const std::string end = (spliceChunks++ > 0 ? "\r\n" : "");
+        if (avail == 0) {
+            pipe.close();
+            sampler.outputClosed(pid);
+            write(end + fragments.lastChunk, &Connection::responseDone);
+            return;
+        }
+        spliceRemaining = std::min<size_t>(avail, config.chunkSize);
+        write(end + chunkHeader(spliceRemaining), &Connection::spliceChunk);
+    }
+
+    /** Move the data of the current chunk from pipe to socket, waiting
+        for the socket to be writable if it fills up. */
+    void spliceChunk() {
+        sock.native_non_blocking(true);
+        while (spliceRemaining > 0) {
+            const ssize_t moved = splice(pipe.native_handle(), nullptr,
+                sock.native_handle(), nullptr, spliceRemaining,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (moved > 0) {
+                spliceRemaining -= moved;
+                metrics.bytesSent += moved;
+            } else if ((moved == -1) && (errno == EAGAIN)) {
+                sock.async_wait(tcp::socket::wait_write, strand.wrap(
+                    [self = shared_from_this()](
+                        const boost::system::error_code& ec) {
+                        if (!ec) {
+                            self->spliceChunk();
+                        }
+                    }));
+                return;
+            } else {
+                return;  // Client went away
+            }
+        }
+        waitRawOutput();
+    }
+
+    /** Wait for the next request or end the connection once a response
+        has been completely sent. */
+    void responseDone() {
+        metrics.response.observeSince(requestStart);
+        if (keepAlive) {
+            start();
         } else {
-            Send contents of the file to the client.
-            sendData(getMimeType(path), -1, dataFile, os, line, t);
+            close();
+        }
+    }
+
+    /** Write data to the client and then call the given method. */
+    void write(std::string data, void (Connection::*next)()) {
+        outBuf = std::move(data);
+        write(std::array<const_buffer, 1>{buffer(outBuf)}, next);
+    }
+
+    /** Write buffers (which must stay valid until then, e.g., outBuf
+        or fragments) to the client with a single gather-write and then
+        call the given method. */
+    template<size_t N>
+    void write(const std::array<const_buffer, N>& bufs,
+               void (Connection::*next)()) {
+        responseStarted();
+        async_write(sock, bufs, strand.wrap(
+            [self = shared_from_this(), next](
+                const boost::system::error_code& ec, size_t len) {
+                metrics.bytesSent += len;
+                if (!ec) {
+                    ((*self).*next)();
+                } else {
+                    self->writeFailed();
+                }
+            }));
+    }
+
+    /** Stop relaying the output of a command once the client went away.
+        Closing the pipe makes the child get SIGPIPE rather than block
+        on a full pipe, so the sampler reaps it (releasing its slot) and
+        lets go of this connection. */
+    void writeFailed() {
+        failed = true;
+        flushTimer.cancel();
+        if (pipe.is_open()) {
+            pipe.close();
+            sampler.outputClosed(pid);
+        }
+        outputDone = true;
+    }
+
+    /** Record the time to the first byte of the response (when it is
+        handed to the socket). */
+    void responseStarted() {
+        if (!firstByteSent) {
+            firstByteSent = true;
+            metrics.firstByte.observeSince(requestStart);
+        }
+    }
+
+    /** Gracefully end the connection after the response is sent. */
+    void close() {
+        boost::system::error_code ec;
+        sock.shutdown(tcp::socket::shutdown_both, ec);
+        sock.close(ec);
+    }
+
+    io_service::strand strand;
+    tcp::socket sock;
+    posix::stream_descriptor pipe;
+    steady_timer idleTimer, flushTimer;
+    std::vector<char> reqBuf;
+    size_t reqLen = 0;
+    RequestParser parser;
+    std::string encoding;  // Content-encoding accepted by the client
+    std::string cacheKey;  // Key in the CommandCache of a command run
+    std::string captured;  // Output of that command, to be cached
+    int cacheTtl = 0;
+    std::unique_ptr<Compressor> gzip;
+    std::string outBuf, pending;
+    MappedFilePtr fileBody;
+    int fileFd = -1;
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0, spliceRemaining = 0;
+    int spliceChunks = 0;
+    std::vector<char> pipeBuf;
+    int pid = -1, requests = 0;
+    ChildResult result;
+    bool outputDone = false, statsDone = false, keepAlive = false;
+    bool waiting = false, reading = false, writing = false;
+    bool eventsDone = false;
+    bool failed = false;   // A write to the client failed
+    std::chrono::steady_clock::time_point requestStart;
+    bool firstByteSent = false;
+};
+
+/**
+ * Asynchronously accept the next client connection.  The handler
+ * starts processing the client and queues accepting the next one.
+ * 
+ * @param service The io_service processing client connections.
+ * @param server The socket that accepts connections.
+ */
+void acceptClient(io_service& service, tcp::acceptor& server) {
+    auto client = std::make_shared<Connection>(service);
+    server.async_accept(client->socket(),
+        [&service, &server, client](const boost::system::error_code& ec) {
+            if (!ec) {
+                setCloseOnExec(client->socket().native_handle());
+                // Responses are written in pieces, so do not let Nagle's
+                // algorithm hold back the last piece of each response.
+                client->socket().set_option(tcp::no_delay(true));
+                client->start();
+            }
+            acceptClient(service, server);
+        });
+}
+
+/**
+ * Periodically print the connection and thread counts so that it is
+ * easy to see the thread count staying flat as clients are added.
+ * 
+ * @param timer The timer used to schedule the next report.
+ * @param ioThreads The number of threads running the io_service.
+ */
+void reportCounts(steady_timer& timer, unsigned int ioThreads) {
+    timer.expires_after(std::chrono::seconds(config.reportInterval));
+    timer.async_wait([&timer, ioThreads](const boost::system::error_code& ec) {
+        if (!ec) {
+            std::cout << "Connections: " << activeConnections << " active, "
+                      << totalConnections << " total; Threads: "
+                      << processThreadCount() << " (" << ioThreads
+                      << " io)\n" << limiter.report() << std::endl;
+            reportCounts(timer, ioThreads);
+        }
+    });
+}
+
+/** Map the history file given with --history, if any. */
+void openHistory() {
+    if (!config.historyFile.empty() &&
+        !history.open(config.historyFile, config.historySize)) {
+        std::cerr << "Not keeping history: unable to map "
+                  << config.historyFile << ": " << strerror(errno) << '\n';
+    }
+}
+
+/**
+ * Runs the program as a server that listens to incoming connections.
+ * Connections are processed asynchronously by a fixed number of threads
+ * (one per core by default) rather than a thread per connection.
+ * 
+ * @param port The port number on which the server should listen.
+ */
+void runServer(int port) {
+    // Create the spawner while there is only 1 thread.
+    spawner();
+    openHistory();
+    // Setup a server socket to accept connections on the socket
+    io_service service;
+    // Create end point
+    tcp::endpoint myEndpoint(tcp::v4(), port);
+    // Create a socket that accepts connections
+    tcp::acceptor server(service, myEndpoint);
+    setCloseOnExec(server.native_handle());
+    const unsigned int threads = (config.threads != 0 ? config.threads :
+        std::max(1u, std::thread::hardware_concurrency()));
+    std::cout << "Server is listening on " << port << " with " << threads
+              << " threads & ready to process clients...\n";
+    acceptClient(service, server);
+    steady_timer timer(service);
+    if (config.reportInterval > 0) {
+        reportCounts(timer, threads);
+    }
+    // Process client connections on a fixed pool of threads...forever
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; (i < threads); i++) {
+        pool.emplace_back([&service] { service.run(); });
+    }
+    service.run();
+    for (auto& thr : pool) {
+        thr.join();
+    }
+}
+
+/**
+ * Microbenchmark comparing the spawners: measures how long starting a
+ * child (true) takes with each spawner as the memory (RSS) of this
+ * process grows, while it has as many idle threads as the server would.
+ */
+void runSpawnBench() {
+    using namespace std::chrono;
+    const std::vector<std::string> names = {"fork", "posix", "zygote"};
+    std::vector<std::unique_ptr<Spawner>> spawners;
+    for (const std::string& name : names) {
+        spawners.push_back(makeSpawner(name));  // Zygote while still small
+    }
+    std::promise<void> quit;
+    std::shared_future<void> stop = quit.get_future().share();
+    std::vector<std::thread> idle;
+    const unsigned int threads = (config.threads != 0 ? config.threads :
+        std::max(1u, std::thread::hardware_concurrency()));
+    for (unsigned int i = 1; (i < threads); i++) {
+        idle.emplace_back([stop] { stop.wait(); });
+    }
+    const int spawns = 200;
+    const int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    std::cout << "Average time to start a child (usec) with " << threads
+              << " threads\nRSS (MB)";
+    for (const std::string& name : names) {
+        std::cout << '\t' << name;
+    }
+    std::cout << std::endl;
+    std::vector<char> ballast;
+    for (size_t mb : {0, 64, 256, 1024}) {
+        ballast.resize(mb << 20, 1);  // Touch every page
+        std::cout << mb;
+        for (auto& spawner : spawners) {
+            duration<double, std::micro> total(0);
+            for (int i = 0; (i < spawns); i++) {
+                const auto start = steady_clock::now();
+                const int pid = spawner->spawn({"true"}, devNull, ExecLimits());
+                total += steady_clock::now() - start;
+                waitpid(pid, nullptr, 0);
+            }
+            std::cout << '\t' << static_cast<int>(total.count() / spawns);
+        }
+        std::cout << std::endl;
+    }
+    quit.set_value();
+    for (auto& thr : idle) {
+        thr.join();
+    }
+    close(devNull);
+}
+
+/**
+ * Microbenchmark for the RequestParser: measures how long parsing the
+ * request line & headers (and looking up a few of them) takes for
+ * typical requests, received at once or in a few pieces.
+ */
+void runParseBench() {
+    using namespace std::chrono;
+    const std::string cgi = "GET /cgi-bin/exec?cmd=sleep&args=3 HTTP/1.1\r\n"
+        "Host: localhost:8080\r\nConnection: keep-alive\r\n\r\n";
+    const std::string browser = "GET /index.html HTTP/1.1\r\n"
+        "Host: localhost:8080\r\nConnection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\nUpgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/70.0.3538.77 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/webp,image/apng,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Cookie: session=0123456789abcdef\r\n\r\n";
+    const int iterations = 1000000;
+    std::cout << "Average time to parse a request (nsec)\n"
+              << "Request\tBytes\tWhole\tIn 3 pieces\n";
+    RequestParser parser;
+    size_t found = 0;
+    for (const std::string* req : {&cgi, &browser}) {
+        std::cout << (req == &cgi ? "cgi" : "browser") << '\t'
+                  << req->size();
+        for (const size_t pieces : {1, 3}) {
+            const auto start = steady_clock::now();
+            for (int i = 0; (i < iterations); i++) {
+                parser.reset();
+                for (size_t p = 1; (p <= pieces); p++) {
+                    parser.parse(req->data(), req->size() * p / pieces);
+                }
+                found += parser.keepAlive() + parser.queryParam("cmd").size() +
+                    parser.header("accept-encoding").size();
+            }
+            const duration<double, std::nano> time =
+                steady_clock::now() - start;
+            std::cout << '\t' << time.count() / iterations;
+        }
+        std::cout << std::endl;
+    }
+    // Use the results so the loops are not optimized away.
+    std::cerr << (found == 0 ? "Parsing failed\n" : "");
+}
+
+/**
+ * Obtain the request files (or requests) to be processed in batch mode.
+ * The input may be a directory (all files in it, sorted by name), a
+ * manifest listing 1 request file per line, or a stream of requests
+ * each ending with a blank line.
+ *
+ * @param input The directory, manifest, or stream.
+ * @param names Set to the name used for each request's output file.
+ * @return The text of each request.
+ */
+std::vector<std::string> readBatch(const std::string& input,
+                                   std::vector<std::string>& names) {
+    std::vector<std::string> files;
+    if (DIR* dir = opendir(input.c_str())) {
+        while (const dirent* entry = readdir(dir)) {
+            struct stat info;
+            const std::string path = input + "/" + entry->d_name;
+            if ((stat(path.c_str(), &info) == 0) && S_ISREG(info.st_mode)) {
+                files.push_back(path);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+    } else {
+        std::ifstream is(input);
+        std::string line, request;
+        std::vector<std::string> requests;
+        while (std::getline(is, line)) {
+            if (!request.empty() ||
+                (line.find(" HTTP/") != std::string::npos)) {
+                // A stream of requests: each one ends with a blank line.
+                request += line + "\n";
+                if (line == "\r" || line.empty()) {
+                    requests.push_back(request);
+                    request.clear();
+                }
+            } else if (!line.empty() && (line[0] != '#')) {
+                files.push_back(line);  // A manifest of request files
+            }
+        }
+        if (!request.empty()) {
+            requests.push_back(request);
         }
-    } */
+        names.assign(requests.size(), "request");
+        if (!requests.empty()) {
+            return requests;
+        }
+    }
+    std::vector<std::string> requests;
+    for (const std::string& file : files) {
+        std::ifstream is(file);
+        std::ostringstream text;
+        text << is.rdbuf();
+        requests.push_back(text.str());
+        names.push_back(file.substr(file.rfind('/') + 1));
+    }
+    return requests;
+}
+
+/**
+ * Process many request files (as in the offline mode) concurrently with
+ * a pool of config.threads (or config.maxChildren) workers, or 1 per
+ * request when neither is limited.  The
+ * response to the i-th request is written to "outDir/NNNN-name.out"
+ * and the wall time of each request is printed, in order, once all of
+ * them are done.
+ *
+ * @param input The directory, manifest, or stream of requests.
+ * @param outDir The directory for the output files.
+ * @param genChart If this flag is true then generate data for chart.
+ */
+void runBatch(const std::string& input, const std::string& outDir,
+              bool genChart) {
+    using namespace std::chrono;
+    std::vector<std::string> names;
+    const std::vector<std::string> requests = readBatch(input, names);
+    mkdir(outDir.c_str(), 0755);
+    openHistory();
+    std::vector<std::string> outputs(requests.size());
+    std::vector<double> times(requests.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+        for (size_t i; (i = next++) < requests.size(); ) {
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "/%04zu-", i + 1);
+            outputs[i] = outDir + prefix + names[i] + ".out";
+            std::istringstream is(requests[i]);
+            std::ofstream os(outputs[i]);
+            const auto start = steady_clock::now();
+            serveClient(is, os, genChart);
+            os.flush();
+            times[i] = duration<double, std::milli>(steady_clock::now() -
+                                                    start).count();
+        }
+    };
+    // Requests mostly wait for their commands, so by default run as many
+    // at a time as there may be children (all of them if unlimited).
+    const size_t threads = std::max<size_t>(1, (config.threads != 0 ?
+        config.threads : config.maxChildren != 0 ? config.maxChildren :
+        requests.size()));
+    const auto start = steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t i = 0; (i < std::min(threads, requests.size())); i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thr : workers) {
+        thr.join();
+    }
+    const double wall = duration<double, std::milli>(steady_clock::now() -
+                                                     start).count();
+    // Print the summary in the order of the requests.
+    std::cout << "Time (msec)\tOutput\n";
+    for (size_t i = 0; (i < requests.size()); i++) {
+        std::cout << times[i] << '\t' << outputs[i] << '\n';
+    }
+    std::cout << requests.size() << " requests with " << workers.size()
+              << " threads in " << wall << " msec (total "
+              << std::accumulate(times.begin(), times.end(), 0.0)
+              << " msec)" << std::endl;
+}
+
+/**
+ * Set values in config from command-line options of the form
+ * "--name=value".  Unknown or invalid options are reported and ignored.
+ * 
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments.
+ * @param first Index of first option in argv.
+ */
+void parseServerOptions(int argc, char** argv, int first) {
+    for (int i = first; (i < argc); i++) {
+        const std::string opt = argv[i];
+        const size_t eqPos = opt.find('=');
+        const std::string name = opt.substr(0, eqPos);
+        const std::string value = (eqPos == std::string::npos ? "" :
+                                   opt.substr(eqPos + 1));
+        // Values that are not numbers (where one is needed) are also
+        // reported and ignored.
+        try {
+            if (name == "--threads") {
+                config.threads = std::stoul(value);
+            } else if (name == "--max-header") {
+                config.maxHeaderSize = std::stoul(value);
+            } else if (name == "--max-headers") {
+                config.maxHeaders = std::stoul(value);
+            } else if (name == "--report-interval") {
+                config.reportInterval = std::stoi(value);
+            } else if (name == "--keep-alive-timeout") {
+                config.keepAliveTimeout = std::stoi(value);
+            } else if (name == "--max-requests") {
+                config.maxRequests = std::stoi(value);
+            } else if (name == "--file-cache") {
+                config.fileCacheSize = std::stoul(value);
+            } else if (name == "--max-cached-file") {
+                config.maxCachedFile = std::stoul(value);
+            } else if (name == "--chunk-size") {
+                config.chunkSize = std::max(1ul, std::stoul(value));
+            } else if (name == "--flush-delay") {
+                config.flushDelay = std::stoi(value);
+            } else if (name == "--sample-interval") {
+                config.sampleInterval = std::max(1, std::stoi(value));
+            } else if (name == "--max-children") {
+                config.maxChildren = std::stoul(value);
+            } else if (name == "--max-per-command") {
+                config.maxPerCommand = std::stoul(value);
+            } else if (name == "--command-limit") {
+                const size_t colon = value.rfind(':');
+                config.commandLimits[value.substr(0, colon)] =
+                    std::stoul(value.substr(colon + 1));
+            } else if (name == "--max-queue") {
+                config.maxQueue = std::stoul(value);
+            } else if (name == "--retry-after") {
+                config.retryAfter = std::stoi(value);
+            } else if (name == "--timeout") {
+                config.limits.timeout = std::stoi(value);
+            } else if (name == "--cpu-limit") {
+                config.limits.cpuTime = std::stoi(value);
+            } else if (name == "--mem-limit") {
+                config.limits.memory = std::stol(value);
+            } else if (name == "--spawner") {
+                config.spawner = value;
+            } else if (name == "--gzip-level") {
+                config.gzipLevel = std::min(9, std::max(0, std::stoi(value)));
+            } else if (name == "--gzip-min-size") {
+                config.gzipMinSize = std::stoul(value);
+            } else if (name == "--cache") {
+                const size_t colon = value.rfind(':');
+                config.cacheTtl[value.substr(0, colon)] =
+                    std::stoi(value.substr(colon + 1));
+            } else if (name == "--output-cache") {
+                config.outputCacheSize = std::stoul(value);
+            } else if (name == "--max-cached-output") {
+                config.maxCachedOutput = std::stoul(value);
+            } else if (name == "--max-jobs") {
+                config.maxJobs = std::stoul(value);
+            } else if (name == "--history") {
+                config.historyFile = value;
+            } else if (name == "--history-size") {
+                config.historySize = std::stoul(value);
+            } else if (name == "--max-samples") {
+                config.maxSamples = std::max(2ul, std::stoul(value) & ~1ul);
+            } else {
+                std::cerr << "Ignoring unknown option " << opt << std::endl;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Ignoring invalid option " << opt << std::endl;
+        }
+    }
+}
+
+/**
+ * Run the modes added to the original ones in main: the server with
+ * options, batches of requests, the benchmarks, and the wrapper that
+ * sets the limits of commands started by the posix spawner.  The
+ * original modes (the server without options and 1 request from a
+ * file) are left to main.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments.
+ * @return true if one of the added modes was run.
+ */
+bool runExtraMode(int argc, char** argv) {
+    if ((argc >= 5) && (argv[1] == std::string("--limited-exec"))) {
+        // Set the limits of a command started by the posix spawner
+        runLimited(argc, argv);
+    } else if ((argc >= 2) && (argv[1] == std::string("--spawn-bench"))) {
+        parseServerOptions(argc, argv, 2);
+        runSpawnBench();
+    } else if ((argc == 2) && (argv[1] == std::string("--parse-bench"))) {
+        runParseBench();
+    } else if ((argc >= 4) && (argv[1] == std::string("--batch"))) {
+        // Process many request files concurrently for functional testing
+        const bool genChart = (argc > 4) && (argv[4] == std::string("true"));
+        config.gzipLevel = 0;  // Keep the outputs readable (& comparable)
+        parseServerOptions(argc, argv, (argc > 4) && (argv[4][0] != '-') ?
+                           5 : 4);
+        runBatch(argv[2], argv[3], genChart);
+    } else if ((argc > 2) && (argv[2][0] == '-')) {
+        // Setup the port number and options for use by the server
+        const int port = std::stoi(argv[1]);
+        parseServerOptions(argc, argv, 2);
+        runServer(port);
+    } else {
+        if (argc == 4) {
+            config.gzipLevel = 0;  // Keep the output of 1 request readable
+        }
+        return false;
+    }
+    return true;
 }
 
 //------------------------------------------------------------------
@@ -489,6 +4589,9 @@ std::string url_decode(std::string str) {
  * from the user.
  */
 int main(int argc, char** argv) {
+    if (runExtraMode(argc, argv)) {
+        return 0;
+    }
     if (argc == 2) {
         // Setup the port number for use by the server
         const int port = std::stoi(argv[1]);
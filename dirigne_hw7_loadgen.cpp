@@ -0,0 +1,582 @@
+/*
+ * A load generator for the web-server in dirigne_hw7.cpp.
+ *
+ * Runs a number of clients concurrently for a given duration, each one
+ * sending requests (over a persistent connection) picked at random from
+ * a weighted mix of workloads: requests replayed from files (such as
+ * base_case1_inputs.txt) and synthetic static-file and cgi-bin requests.
+ * It reports requests/sec, latency percentiles, and errors, as text or
+ * as JSON to track performance across changes.
+ *
+ * Copyright (C) 2018 Noah Dirig
+ */
+
+// Build with: g++ -std=c++17 -Wall -O2 dirigne_hw7_loadgen.cpp
+//                 -o dirigne_hw7_loadgen -lpthread
+//
+// Run with: [host] [port] [--concurrency=N] [--duration=sec]
+//     [--replay=file[:weight]]... [--static=weight] [--cgi=weight]
+//     [--static-path=path] [--cgi-path=path] [--timeout=sec] [--close]
+//     [--json]
+// For example, against a server started with "dirigne_hw7 8080":
+//     dirigne_hw7_loadgen localhost 8080 --concurrency=50 --duration=10
+//         --static=8 --cgi=2 --replay=base_case2_inputs.txt:1 --json
+
+#include <boost/asio.hpp>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Using namespaces to streamline code below
+using namespace boost::asio;
+using namespace boost::asio::ip;
+using Clock = std::chrono::steady_clock;
+
+/** Settings from the command-line options of the form "--name=value". */
+struct LoadConfig {
+    std::string host = "localhost", port = "8080";
+    /** Number of clients sending requests concurrently. */
+    int concurrency = 10;
+    /** Seconds for which requests are sent. */
+    int duration = 10;
+    /** Weights of the synthetic static-file & cgi-bin requests. */
+    int staticWeight = 0, cgiWeight = 0;
+    std::string staticPath = "/index.html";
+    std::string cgiPath = "/cgi-bin/exec?cmd=echo&args=hello";
+    /** Seconds to wait for a response before giving up on it. */
+    int timeout = 5;
+    /** Send "Connection: close" so each request uses a new connection. */
+    bool close = false;
+    /** Print results as JSON rather than text. */
+    bool json = false;
+};
+
+/** One kind of request sent by the clients. */
+struct Workload {
+    std::string name;     // Shown in the results
+    std::string request;  // The request line & headers
+    int weight;           // Relative frequency of the request
+};
+
+/** Results of the requests of 1 workload (sent by 1 or all clients). */
+struct Results {
+    long requests = 0;       // Responses received (of any status)
+    long httpErrors = 0;     // Responses with status >= 400
+    long ioErrors = 0;       // Failed connects, sends, or receives
+    long timeouts = 0;       // Responses not received within the timeout
+    long bytes = 0;          // Bytes of responses received
+    std::vector<double> latencies;  // Of each response, in ms
+
+    void add(const Results& other) {
+        requests   += other.requests;
+        httpErrors += other.httpErrors;
+        ioErrors   += other.ioErrors;
+        timeouts   += other.timeouts;
+        bytes      += other.bytes;
+        latencies.insert(latencies.end(), other.latencies.begin(),
+                         other.latencies.end());
+    }
+};
+
+/**
+ * Build a GET request for a path.
+ *
+ * @param path The path to request.
+ * @param close If true the server is asked to close the connection.
+ * @return The request line & headers.
+ */
+std::string makeRequest(const std::string& path, bool close) {
+    return "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nConnection: " +
+        (close ? "close" : "keep-alive") + "\r\n\r\n";
+}
+
+/**
+ * Read a request to be replayed from a file: the request line and
+ * headers up to the first blank line.
+ *
+ * @param path The file, such as base_case1_inputs.txt.
+ * @return The request or "" if the file could not be read.
+ */
+std::string readRequest(const std::string& path) {
+    std::ifstream is(path);
+    std::string line, request;
+    while (std::getline(is, line) && (line != "\r") && !line.empty()) {
+        if (line.back() != '\r') {
+            line += '\r';
+        }
+        request += line + "\n";
+    }
+    return request.empty() ? "" : request + "\r\n";
+}
+
+/** Thrown when a response is not received by its deadline. */
+class TimedOut : public std::runtime_error {
+public:
+    TimedOut() : std::runtime_error("Response timed out") {}
+};
+
+/**
+ * Wait for the socket to be readable or writable, but no longer than a
+ * deadline, so that a stalled server cannot block a client past it.
+ *
+ * @param sock The connection to the server.
+ * @param events POLLIN or POLLOUT.
+ * @param deadline The time by which the socket must be ready, or
+ * TimedOut is thrown.
+ */
+void waitFor(tcp::socket& sock, short events, Clock::time_point deadline) {
+    using namespace std::chrono;
+    pollfd pfd = {sock.native_handle(), events, 0};
+    int ready;
+    do {
+        const long wait = duration_cast<milliseconds>(deadline -
+                                                      Clock::now()).count();
+        if (wait <= 0) {
+            throw TimedOut();
+        }
+        ready = poll(&pfd, 1, wait);
+    } while ((ready == -1) && (errno == EINTR));
+    if (ready == 0) {
+        throw TimedOut();
+    }
+}
+
+/**
+ * Send a request to the server, waiting no longer than a deadline for
+ * it to accept the data.  The socket is non-blocking, so each write
+ * only sends what fits in the socket's buffer.
+ *
+ * @param sock The connection to the server.
+ * @param request The request to be sent.
+ * @param deadline The time by which the request must be sent.
+ */
+void sendRequest(tcp::socket& sock, const std::string& request,
+                 Clock::time_point deadline) {
+    for (size_t sent = 0; (sent < request.size()); ) {
+        waitFor(sock, POLLOUT, deadline);
+        boost::system::error_code ec;
+        sent += sock.write_some(buffer(request.data() + sent,
+                                       request.size() - sent), ec);
+        if (ec && (ec != error::would_block)) {
+            throw boost::system::system_error(ec);
+        }
+    }
+}
+
+/**
+ * Read more data from the server, waiting no longer than a deadline.
+ *
+ * @param sock The connection to the server.
+ * @param buf The data received is appended to this buffer.
+ * @param deadline The time by which data must be received.
+ * @return false if the server closed the connection.
+ */
+bool readMore(tcp::socket& sock, streambuf& buf, Clock::time_point deadline) {
+    waitFor(sock, POLLIN, deadline);
+    boost::system::error_code ec;
+    const size_t count = sock.read_some(buf.prepare(65536), ec);
+    if (ec == error::eof) {
+        return false;
+    } else if (ec && (ec != error::would_block)) {
+        throw boost::system::system_error(ec);
+    }
+    buf.commit(count);
+    return true;
+}
+
+/**
+ * Read from the server until the data received contains a delimiter.
+ *
+ * @param sock The connection to the server.
+ * @param buf The data received from the server and not used yet.
+ * @param delim The delimiter, such as "\r\n".
+ * @param deadline The time by which the data must be received.
+ * @return The length of the data up to and including the delimiter.
+ */
+size_t readUntil(tcp::socket& sock, streambuf& buf, const std::string& delim,
+                 Clock::time_point deadline) {
+    while (true) {
+        const auto begin = buffers_begin(buf.data());
+        const auto end = buffers_end(buf.data());
+        const auto pos = std::search(begin, end, delim.begin(), delim.end());
+        if (pos != end) {
+            return (pos - begin) + delim.size();
+        } else if (!readMore(sock, buf, deadline)) {
+            throw boost::system::system_error(error::eof);
+        }
+    }
+}
+
+/**
+ * Change a replayed request to ask the server to close the connection,
+ * replacing its Connection header (if any).
+ *
+ * @param request The request line & headers, ending with a blank line.
+ * @return The request with a "Connection: close" header.
+ */
+std::string closeRequest(const std::string& request) {
+    std::istringstream is(request);
+    std::string line, out;
+    while (std::getline(is, line) && (line != "\r")) {
+        std::string name = line.substr(0, line.find(':'));
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name != "connection") {
+            out += line + "\n";
+        }
+    }
+    return out + "Connection: close\r\n\r\n";
+}
+
+/**
+ * Read 1 response from the server.  The body is read (and discarded)
+ * according to its Content-Length or chunked transfer-encoding.
+ *
+ * @param sock The connection to the server.
+ * @param buf The data received from the server and not used yet.
+ * @param deadline The time by which the whole response must be
+ * received, or TimedOut is thrown.
+ * @param close Set to true if the server closes the connection after
+ * the response.
+ * @param bytes Incremented by the bytes in the response.
+ * @return The HTTP status code of the response.
+ */
+int readResponse(tcp::socket& sock, streambuf& buf,
+                 Clock::time_point deadline, bool& close, long& bytes) {
+    const size_t headLen = readUntil(sock, buf, "\r\n\r\n", deadline);
+    std::string head(buffers_begin(buf.data()),
+                     buffers_begin(buf.data()) + headLen);
+    buf.consume(headLen);
+    bytes += headLen;
+    std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+    const int status = std::stoi(head.substr(head.find(' ') + 1));
+    close = (head.find("\r\nconnection: close") != std::string::npos);
+    // Helper to read & discard exactly len bytes of the body.
+    auto skip = [&sock, &buf, &bytes, deadline](size_t len) {
+        while (buf.size() < len) {
+            if (!readMore(sock, buf, deadline)) {
+                throw boost::system::system_error(error::eof);
+            }
+        }
+        buf.consume(len);
+        bytes += len;
+    };
+    const size_t lenPos = head.find("\r\ncontent-length:");
+    if (head.find("\r\ntransfer-encoding: chunked") != std::string::npos) {
+        size_t size;
+        do {
+            const size_t lineLen = readUntil(sock, buf, "\r\n", deadline);
+            const std::string line(buffers_begin(buf.data()),
+                                   buffers_begin(buf.data()) + lineLen);
+            skip(lineLen);
+            size = std::stoul(line, nullptr, 16);
+            skip(size + 2);  // The data and the CRLF after it
+        } while (size > 0);
+    } else if (lenPos != std::string::npos) {
+        skip(std::stoul(head.substr(lenPos + 17)));
+    } else {
+        // No length: the body ends when the connection is closed.
+        while (readMore(sock, buf, deadline)) {}
+        bytes += buf.size();
+        buf.consume(buf.size());
+        close = true;
+    }
+    return status;
+}
+
+/**
+ * Body of each client: send requests until the end time, over a
+ * persistent connection that is re-opened when the server closes it or
+ * an error occurs.
+ *
+ * @param workloads The kinds of requests to be sent.
+ * @param endpoints The address(es) of the server.
+ * @param end The time at which to stop sending requests.  A response
+ * not received by then is abandoned (and not counted).
+ * @param timeout The time to wait for each response.
+ * @param seed The seed for picking workloads at random.
+ * @param results The results of each workload for this client.
+ */
+void runClient(const std::vector<Workload>& workloads,
+               const tcp::resolver::results_type& endpoints,
+               Clock::time_point end, Clock::duration timeout,
+               unsigned int seed, std::vector<Results>& results) {
+    std::vector<int> weights;
+    for (const Workload& work : workloads) {
+        weights.push_back(work.weight);
+    }
+    std::mt19937 random(seed);
+    std::discrete_distribution<int> pick(weights.begin(), weights.end());
+    io_service service;
+    tcp::socket sock(service);
+    streambuf buf;
+    while (Clock::now() < end) {
+        const int w = pick(random);
+        Results& res = results[w];
+        const Clock::time_point start = Clock::now();
+        const Clock::time_point deadline = std::min(start + timeout, end);
+        try {
+            if (!sock.is_open()) {
+                connect(sock, endpoints);
+                sock.set_option(tcp::no_delay(true));
+                sock.non_blocking(true);  // Waits are bounded by poll
+            }
+            sendRequest(sock, workloads[w].request, deadline);
+            bool close;
+            const int status = readResponse(sock, buf, deadline, close,
+                                            res.bytes);
+            res.latencies.push_back(std::chrono::duration<double,
+                std::milli>(Clock::now() - start).count());
+            res.requests++;
+            res.httpErrors += (status >= 400);
+            if (close) {
+                sock.close();
+                buf.consume(buf.size());
+            }
+        } catch (const TimedOut&) {
+            res.timeouts += (deadline < end);
+            boost::system::error_code ec;
+            sock.close(ec);
+            buf.consume(buf.size());
+        } catch (const std::exception&) {
+            res.ioErrors++;
+            boost::system::error_code ec;
+            sock.close(ec);
+            buf.consume(buf.size());
+        }
+    }
+}
+
+/**
+ * Obtain a percentile of sorted latencies (nearest-rank method).
+ *
+ * @param sorted The latencies in ascending order.
+ * @param pct The percentile, e.g., 99.9.
+ * @return The latency or 0 if there are none.
+ */
+double percentile(const std::vector<double>& sorted, double pct) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    const size_t rank = std::ceil(pct / 100 * sorted.size());
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+/**
+ * Quote a string for JSON output, escaping quotes, backslashes and
+ * control characters.
+ *
+ * @param str The string, such as the name of a workload.
+ * @return The JSON string literal.
+ */
+std::string jsonString(const std::string& str) {
+    std::string out = "\"";
+    for (const char c : str) {
+        if ((c == '"') || (c == '\\')) {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+/**
+ * Print the results of a workload (or all of them) as text or JSON.
+ *
+ * @param os The stream to which the results are written.
+ * @param name The name of the workload.
+ * @param res The results, with latencies sorted.
+ * @param seconds The time for which requests were sent.
+ * @param json If true print a JSON object, otherwise a line of text.
+ */
+void printResults(std::ostream& os, const std::string& name,
+                  const Results& res, double seconds, bool json) {
+    const std::vector<double>& lat = res.latencies;
+    const double pcts[] = {50, 90, 99, 99.9};
+    if (json) {
+        os << "{\"name\": " << jsonString(name) << ", \"requests\": "
+           << res.requests
+           << ", \"requests_per_sec\": " << res.requests / seconds
+           << ", \"http_errors\": " << res.httpErrors << ", \"io_errors\": "
+           << res.ioErrors << ", \"timeouts\": " << res.timeouts
+           << ", \"bytes\": " << res.bytes
+           << ", \"latency_ms\": {";
+        for (double pct : pcts) {
+            os << "\"p" << pct << "\": " << percentile(lat, pct) << ", ";
+        }
+        os << "\"max\": " << (lat.empty() ? 0 : lat.back()) << "}}";
+    } else {
+        os << std::left << std::setw(24) << name << std::right
+           << std::setw(9) << res.requests << std::setw(11)
+           << std::fixed << std::setprecision(1) << res.requests / seconds
+           << std::setw(7) << res.httpErrors << std::setw(7)
+           << res.ioErrors << std::setw(7) << res.timeouts
+           << std::setprecision(3);
+        for (double pct : pcts) {
+            os << std::setw(10) << percentile(lat, pct);
+        }
+        os << std::setw(10) << (lat.empty() ? 0 : lat.back()) << '\n';
+    }
+}
+
+/**
+ * Set values in config from command-line options of the form
+ * "--name=value" and add the workloads they specify.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments.
+ * @param config The settings to be changed.
+ * @param workloads The workloads to which replayed requests are added.
+ * @return false if an option is invalid.
+ */
+bool parseOptions(int argc, char** argv, LoadConfig& config,
+                  std::vector<Workload>& workloads) {
+    for (int i = 3; (i < argc); i++) {
+        const std::string opt = argv[i];
+        const size_t eqPos = opt.find('=');
+        const std::string name = opt.substr(0, eqPos);
+        const std::string value = (eqPos == std::string::npos ? "" :
+                                   opt.substr(eqPos + 1));
+        if (name == "--concurrency") {
+            config.concurrency = std::max(1, std::stoi(value));
+        } else if (name == "--duration") {
+            config.duration = std::max(1, std::stoi(value));
+        } else if (name == "--static") {
+            config.staticWeight = std::stoi(value);
+        } else if (name == "--cgi") {
+            config.cgiWeight = std::stoi(value);
+        } else if (name == "--static-path") {
+            config.staticPath = value;
+        } else if (name == "--cgi-path") {
+            config.cgiPath = value;
+        } else if (name == "--timeout") {
+            config.timeout = std::max(1, std::stoi(value));
+        } else if (name == "--close") {
+            config.close = true;
+        } else if (name == "--json") {
+            config.json = true;
+        } else if (name == "--replay") {
+            const size_t colon = value.rfind(':');
+            const std::string file = value.substr(0, colon);
+            const std::string request = readRequest(file);
+            if (request.empty()) {
+                std::cerr << "Unable to read request from " << file << '\n';
+                return false;
+            }
+            workloads.push_back({file, request, (colon == std::string::npos ?
+                                 1 : std::stoi(value.substr(colon + 1)))});
+        } else {
+            std::cerr << "Unknown option " << opt << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    LoadConfig config;
+    std::vector<Workload> workloads;
+    if ((argc < 3) || !parseOptions(argc, argv, config, workloads)) {
+        std::cerr << "Usage: " << argv[0] << " <host> <port> [options]\n";
+        return 1;
+    }
+    config.host = argv[1];
+    config.port = argv[2];
+    if (config.close) {
+        for (Workload& work : workloads) {
+            work.request = closeRequest(work.request);
+        }
+    }
+    // Send the static file by default, if nothing else is to be sent.
+    if ((config.staticWeight > 0) ||
+        (workloads.empty() && (config.cgiWeight <= 0))) {
+        workloads.push_back({"static " + config.staticPath,
+                             makeRequest(config.staticPath, config.close),
+                             std::max(1, config.staticWeight)});
+    }
+    if (config.cgiWeight > 0) {
+        workloads.push_back({"cgi " + config.cgiPath,
+                             makeRequest(config.cgiPath, config.close),
+                             config.cgiWeight});
+    }
+    io_service service;
+    const auto endpoints = tcp::resolver(service).resolve(config.host,
+                                                          config.port);
+    // Run the clients, each one with its own results.
+    std::vector<std::vector<Results>> results(config.concurrency,
+        std::vector<Results>(workloads.size()));
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + std::chrono::seconds(config.duration);
+    std::vector<std::thread> clients;
+    for (int i = 0; (i < config.concurrency); i++) {
+        clients.emplace_back(runClient, std::cref(workloads),
+                             std::cref(endpoints), end,
+                             std::chrono::seconds(config.timeout), i + 1,
+                             std::ref(results[i]));
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    const double seconds = std::chrono::duration<double>(
+        Clock::now() - start).count();
+    // Combine the results of the clients for each workload & in total.
+    Results total;
+    std::vector<Results> perWork(workloads.size());
+    for (const auto& client : results) {
+        for (size_t w = 0; (w < workloads.size()); w++) {
+            perWork[w].add(client[w]);
+        }
+    }
+    for (Results& res : perWork) {
+        std::sort(res.latencies.begin(), res.latencies.end());
+        total.add(res);
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    std::ostream& os = std::cout;
+    if (config.json) {
+        os << "{\"concurrency\": " << config.concurrency << ", \"seconds\": "
+           << seconds << ", \"total\": ";
+        printResults(os, "total", total, seconds, true);
+        os << ", \"workloads\": [";
+        for (size_t w = 0; (w < workloads.size()); w++) {
+            os << (w == 0 ? "" : ", ");
+            printResults(os, workloads[w].name, perWork[w], seconds, true);
+        }
+        os << "]}\n";
+    } else {
+        os << config.concurrency << " clients for " << std::fixed
+           << std::setprecision(1) << seconds << " sec; latencies in ms\n"
+           << std::left << std::setw(24) << "Workload" << std::right
+           << std::setw(9) << "Requests" << std::setw(11) << "Req/sec"
+           << std::setw(7) << "HTTP" << std::setw(7) << "I/O"
+           << std::setw(7) << "T/O"
+           << std::setw(10) << "p50" << std::setw(10) << "p90"
+           << std::setw(10) << "p99" << std::setw(10) << "p99.9"
+           << std::setw(10) << "max" << '\n';
+        for (size_t w = 0; (w < workloads.size()); w++) {
+            printResults(os, workloads[w].name, perWork[w], seconds, false);
+        }
+        printResults(os, "total", total, seconds, false);
+    }
+    return (total.requests > 0 ? 0 : 1);
+}
+
+// End of source code
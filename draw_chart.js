@@ -1,20 +1,159 @@
-
 // This script assumes that google charts is loaded before this script
-// in the HTML
+// in the HTML.  The server streams a call to addSample() for each
+// sample of the runtime statistics while the command runs.  To keep the
+// page small for long-running commands, the server has the samples
+// halved (with halveSamples) the same way it downsamples its own.
+// Other pages can watch a command with watchJob(), which receives the
+// same samples as Server-Sent Events, or show the past runs of a command
+// kept by the server with showHistory().  Pages in the original layout
+// (sent by the offline modes) instead define getChartData() with all
+// the points, which is drawn once the charts are loaded.
+
+var samples = [];  // The arguments of each addSample() call
+var chart = null;
+var data = null;   // The points of the chart, added as samples arrive
+var chartOptions = {
+    title: 'Runtime statistics',
+    legend: { position: 'bottom' },
+    series: {0: {targetAxisIndex: 0}, 1: {targetAxisIndex: 1}}
+};
 
 google.charts.load('current', {'packages':['corechart']});
-google.charts.setOnLoadCallback(drawChart);
+google.charts.setOnLoadCallback(function() {
+    var div = document.getElementById('chart');
+    if (div && (typeof getChartData === 'function')) {
+        new google.visualization.LineChart(div).draw(getChartData(),
+                                                     chartOptions);
+    } else if (div) {
+        chart = new google.visualization.LineChart(div);
+        data = new google.visualization.DataTable();
+        data.addColumn('number', 'Time (sec)');
+        data.addColumn('number', 'CPU Usage');
+        data.addColumn('number', 'Memory Usage');
+        samples.forEach(addPoint);
+        drawChart();
+    }
+});
 
-function drawChart() {
-    var data = getChartData();
+// Add a row to the runtime statistics table and a point to the chart
+function addSample(time, userTime, systemTime, memory, minorFaults,
+                   majorFaults, volSwitches, involSwitches, readKB, writeKB) {
+    var sample = Array.prototype.slice.call(arguments);
+    samples.push(sample);
+    addRow(sample);
+    if (data) {
+        addPoint(sample);
+        drawChart();
+    }
+}
 
-    var options = {
-        title: 'Runtime statistics',
-        legend: { position: 'bottom' },
-        series: {0: {targetAxisIndex: 0}, 1: {targetAxisIndex: 1}}
+// Merge adjacent pairs of samples: a merged sample has the values of
+// the later one, except for memory which is the peak of both.
+function halveSamples() {
+    var merged = [];
+    for (var i = 0; i + 1 < samples.length; i += 2) {
+        var sample = samples[i + 1].slice();
+        sample[3] = Math.max(samples[i][3], samples[i + 1][3]);
+        merged.push(sample);
+    }
+    samples = merged;
+    var table = document.getElementById('stats');
+    while (table.rows.length > 1) {
+        table.deleteRow(-1);
+    }
+    samples.forEach(addRow);
+    if (data) {
+        data.removeRows(0, data.getNumberOfRows());
+        samples.forEach(addPoint);
+    }
+}
+
+// Show the statistics of a command run by another request (job id) as
+// the server streams them from /cgi-bin/stream.  The exit code is shown
+// in the element with id 'status' once the command finishes.
+function watchJob(id) {
+    var source = new EventSource('/cgi-bin/stream?id=' + id);
+    source.addEventListener('halve', function() {
+        halveSamples();
+    });
+    source.addEventListener('sample', function(event) {
+        addSample.apply(null, JSON.parse(event.data));
+    });
+    source.addEventListener('done', function(event) {
+        var result = JSON.parse(event.data);
+        document.getElementById('status').textContent = 'Exit code: ' +
+            result.exitCode + (result.reason ? ' (' + result.reason + ')' : '');
+        source.close();
+    });
+    source.onerror = function() {
+        document.getElementById('status').textContent =
+            'Job not found or stream ended';
+        source.close();
     };
+}
 
-    var chart = new google.visualization.LineChart(document.getElementById('chart'));
+// Show the last n runs of a command from /cgi-bin/history: a row per run
+// in the table with id 'runs', their runtime and peak memory in the
+// element with id 'history' as a chart, and the percentiles of their
+// runtime in the element with id 'summary'.
+function showHistory(cmd, n) {
+    var url = '/cgi-bin/history?cmd=' + encodeURIComponent(cmd) + '&n=' + n;
+    fetch(url).then(function(response) {
+        return response.json();
+    }).then(function(history) {
+        var table = document.getElementById('runs');
+        history.runs.forEach(function(run) {
+            var cells = [new Date(run.start).toLocaleString(), run.args,
+                         run.exitCode, run.runTime / 1000, run.userTime,
+                         run.systemTime, run.maxRss];
+            var row = table.insertRow(-1);
+            for (var i = 0; i < cells.length; i++) {
+                row.insertCell(-1).textContent = cells[i];
+            }
+        });
+        document.getElementById('summary').textContent = history.runs.length +
+            ' of ' + history.total + ' runs shown.  Runtime (sec): p50 ' +
+            history.p50 / 1000 + ', p95 ' + history.p95 / 1000 +
+            '; Peak memory: ' + history.peakMemory + ' KB';
+        google.charts.setOnLoadCallback(function() {
+            var runs = new google.visualization.DataTable();
+            runs.addColumn('number', 'Run');
+            runs.addColumn('number', 'Runtime (sec)');
+            runs.addColumn('number', 'Peak memory (KB)');
+            history.runs.slice().reverse().forEach(function(run, i) {
+                runs.addRow([i + 1, run.runTime / 1000, run.maxRss]);
+            });
+            new google.visualization.LineChart(
+                document.getElementById('history')).draw(runs, {
+                    title: 'Last runs of ' + history.cmd,
+                    legend: { position: 'bottom' },
+                    series: {0: {targetAxisIndex: 0},
+                             1: {targetAxisIndex: 1}}
+                });
+        });
+    }).catch(function() {
+        document.getElementById('summary').textContent =
+            'No history is kept by the server';
+    });
+}
+
+function addRow(sample) {
+    var cells = sample.slice(0, 4).concat([sample[4] + ' / ' + sample[5],
+        sample[6] + ' / ' + sample[7], sample[8], sample[9]]);
+    var row = document.getElementById('stats').insertRow(-1);
+    for (var i = 0; i < cells.length; i++) {
+        row.insertCell(-1).textContent = cells[i];
+    }
+}
+
+function addPoint(sample) {
+    data.addRow([sample[0], sample[1] + sample[2], sample[3]]);
+}
+
+function drawChart() {
+    if (!chart || samples.length == 0) {
+        return;
+    }
 
-    chart.draw(data, options);
+    chart.draw(data, chartOptions);
 }